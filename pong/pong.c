@@ -6,42 +6,286 @@
 #include <math.h>
 #include <stdlib.h>
 #include <errno.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
 
 #define MAXPACKETSIZE 0xFFFF
 #define PORTNUM 1200
+#define TRACE_CHUNK 4096
+#define LOCKSTEP_TICK 10
+#define LOCKSTEP_WINDOW 256 /* ticks of input kept, must be a power of two */
+#define LOCKSTEP_MAX_INPUTS 64
+#define HIST_SUB_BITS 5
+#define HIST_SUB ( 1 << HIST_SUB_BITS )
+#define HIST_BUCKETS ( 40 * HIST_SUB ) /* nanoseconds up to nearly five hours */
+#define MULTIBALL_CELL 40 /* broad phase grid spacing, no less than BALL_SIZE */
+#define MULTIBALL_MAX 3000 /* keeps PACKET_BALLS inside one datagram */
+#define SEATS 4 /* one per paddle */
+#define SEAT_QUEUE 8 /* packets a seat can have waiting before the oldest goes */
+#define CLOCK_SAMPLES 8 /* pings the clock filter picks the best of */
+#define LAGCOMP_HISTORY 64 /* physics steps of ball history, a power of two */
+#define LAGCOMP_MAX_MS 100 /* default cap on how far back a hit is judged */
+/* The least time a ball takes from touching a side paddle to scoring.  A hit
+   judged further back than that comes after the point is already lost. */
+#define LAGCOMP_REACH_MS ( ( PADDLE_WIDTH + BALL_SIZE ) * 1000 / BALL_SPEED )
+#define EVENT_LOG 16 /* events kept for resending, the most one packet carries */
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec( thread )
+#else
+#define THREAD_LOCAL __thread
+#endif
 
 #define dist_form( x, y ) ( sqrt( ( x * x ) + ( y * y ) ) )
 
+/* Ball and paddle math is done in "scalars".  By default these are floats,
+   which is fine for a local game but lets two machines drift apart once the
+   compiler or CPU rounds differently.  Building with FIXED_PHYSICS swaps them
+   for 16.16 fixed point, which is bit-identical everywhere and is what
+   lockstep play and replays should be built with. */
+#ifdef FIXED_PHYSICS
+typedef int32_t scalar;
+#define SCALAR_ONE 65536
+#define INT_TO_SCALAR( i ) ( (scalar)( (i) * SCALAR_ONE ) )
+#define SCALAR_TO_INT( s ) ( (int)( (s) / SCALAR_ONE ) )
+#define SCALAR_PER_MS( v, ms ) ( (scalar)( ( (int64_t)(v) * (int64_t)(ms) ) / 1000 ) )
+#define SCALAR_MUL( a, b ) ( (scalar)( ( (int64_t)(a) * (b) ) / SCALAR_ONE ) )
+#define SCALAR_MAX 0x7FFFFFFF
+#define SCALAR_TO_DOUBLE( s ) ( (double)(s) / SCALAR_ONE )
+#else
+typedef float scalar;
+#define INT_TO_SCALAR( i ) ( (scalar)(i) )
+#define SCALAR_TO_INT( s ) ( (int)(s) )
+#define SCALAR_PER_MS( v, ms ) ( (v) * ( (ms) / 1000.f ) )
+#define SCALAR_MUL( a, b ) ( (a) * (b) )
+#define SCALAR_MAX 1e30f
+#define SCALAR_TO_DOUBLE( s ) ( (double)(s) )
+#endif
+
+/*
+ * The game state holds only what can change during a match, since it is
+ * what gets copied into every update, keyframe and rollback.  Where the
+ * paddles and ball are drawn and collide is worked out from it on demand
+ * by paddle_rects() and ball_rect().
+ */
 #pragma pack(push, 4)
 struct player
 {
-	SDL_Rect rect[2];
-	float offset;
-	int score;
+	scalar offset; /* of the first paddle along its side */
+	scalar split; /* second paddle's offset less the first's, only ever set in four-client mode */
 };
 
 struct ball
 {
-	float x, y;
-	float xv, yv;
-	SDL_Rect rect;
-	int colliding;
+	scalar x, y;
+	scalar xv, yv;
+	uint32_t colliding;
 };
 
 struct gamestate
 {
 	uint32_t time;
+	uint16_t score[2];
 	struct player players[2];
 	struct ball ball;
 };
 #pragma pack(pop)
 
+#define STATE_WORDS ( sizeof(struct gamestate) / sizeof(uint32_t) )
+
+/* A 64-bit hash of a gamestate, kept up to date a tick at a time.  Each
+   word is mixed on its own and the results XORed together, so only the
+   words that changed since last time need mixing again, which most ticks
+   is the time and the ball. */
+struct statehash
+{
+	uint32_t words[STATE_WORDS]; /* as of the last update */
+	uint64_t mixed[STATE_WORDS]; /* and what each of them mixed to */
+	uint64_t hash;
+};
+
 struct net
 {
 	UDPsocket socket;
 	IPaddress addr;
+	Uint16 port; /* local port to bind, 0 for any */
 	int state;
 	int type;
+	UDPpacket *rx; /* reused for every receive */
+	int seat; /* paddle a four-client host gave us, 0 if it isn't one */
+};
+
+/* A received datagram, read in place.  It points into the net's receive
+   packet, so it's only good until the next net_recv() on that net; use the
+   packet_*() functions to get at it as anything more than a type. */
+struct packet_view
+{
+	const uint8_t *data;
+	int len;
+	uint32_t type;
+	IPaddress from;
+};
+
+/* An encoded packet shared by every connection it is sent to.  Whoever
+   holds a pointer holds a reference. */
+struct snapshot
+{
+	SDL_atomic_t refs;
+	int len;
+	uint8_t data[1];
+};
+
+/* How often one connection gets snapshots.  Its pings say how many it has
+   had and its round trip, and the rate climbs a step at a time while they
+   show nothing lost and no queue building, and halves when they do. */
+struct send_rate
+{
+	uint32_t hz; /* 0 until first used */
+	int due; /* gets this frame's snapshots */
+	Uint32 next; /* when the next is due */
+	uint32_t sent;
+	uint32_t sent_then; /* sent and received as of the last verdict */
+	uint32_t received_then;
+	uint32_t best_rtt;
+	int reports;
+	Uint32 held; /* no backing off again before this */
+};
+
+/* How far one receiver has got through the events */
+struct event_peer
+{
+	uint32_t acked; /* it has every event before this */
+	uint32_t sent_next; /* events.next when we last sent it any */
+	Uint32 sent;
+};
+
+struct spectator
+{
+	IPaddress addr;
+	uint32_t last_heard;
+	int live; /* finished the handshake */
+	struct event_peer ev;
+	struct send_rate rate;
+};
+
+/* The packets array is kept parallel to the spectator list, so a fan-out
+   only has to point each packet at the snapshot and hand them all to
+   SDLNet_UDP_SendV() in one go */
+struct spectators
+{
+	struct spectator *list;
+	UDPpacket *packets;
+	UDPpacket **vec;
+	int count;
+	int cap;
+};
+
+/* A send held back by the impairment layer until it is due */
+struct impaired_packet
+{
+	Uint32 due;
+	uint32_t seq; /* keeps packets due at the same time in order */
+	UDPsocket socket;
+	IPaddress to;
+	int len;
+	uint8_t data[1];
+};
+
+/* Emulated network conditions applied to everything this process sends.
+   The queue is a binary heap ordered by due time. */
+struct impairment
+{
+	int active;
+	Uint32 delay;
+	Uint32 jitter;
+	double loss; /* percentages */
+	double dup;
+	double reorder;
+	Uint32 rate; /* kbit/s, 0 for no cap */
+	uint32_t seed;
+	uint64_t link_free; /* microseconds, when the capped link is next idle */
+	uint32_t seq;
+	struct impaired_packet **queue;
+	int count;
+	int cap;
+	UDPpacket out;
+};
+
+/* Log-linear histogram: HIST_SUB buckets for every power of two, so each
+   bucket is within 1/HIST_SUB of the values it holds */
+struct histogram
+{
+	uint32_t counts[HIST_BUCKETS];
+	uint32_t total;
+	uint64_t max;
+};
+
+/* The parts of a frame that get their own timer */
+enum
+{
+	PHASE_POLL,
+	PHASE_RECV,
+	PHASE_CMDS,
+	PHASE_ADVANCE,
+	PHASE_RENDER,
+	PHASE_PRESENT,
+	PHASE_SEND,
+	PHASE_FRAME,
+	PHASE_COUNT
+};
+
+struct timers
+{
+	int active;
+	Uint32 interval; /* ms between dumps, 0 for only at exit */
+	Uint32 last_dump;
+	Uint64 freq;
+	Uint64 started[PHASE_COUNT];
+	struct histogram recent[PHASE_COUNT]; /* since the last dump */
+	struct histogram run[PHASE_COUNT];
+};
+
+struct trace_record
+{
+	Uint64 ts; /* performance counter */
+	const char *name; /* must outlive the trace */
+	int arg;
+	int ph; /* 'B'egin, 'E'nd or 'i'nstant */
+};
+
+struct trace_chunk
+{
+	struct trace_chunk *next;
+	int len;
+	struct trace_record records[TRACE_CHUNK];
+};
+
+/* Only the owning thread ever appends, so recording takes no locks.  The
+   buffers are read once every thread but main has been joined. */
+struct trace_thread
+{
+	struct trace_thread *next;
+	const char *name;
+	int tid;
+	struct trace_chunk *head;
+	struct trace_chunk *tail;
+};
+
+struct tracer
+{
+	int active;
+	const char *path;
+	Uint64 base;
+	Uint64 freq;
+	struct trace_thread *threads; /* pushed with a CAS as threads register */
+	SDL_atomic_t next_tid;
 };
 
 #pragma pack(push, 4)
@@ -51,17 +295,62 @@ struct cmd
 	uint32_t time;
 	union
 	{
-		float offset; /* player movement */
+		scalar offset; /* player movement */
 		int direction; /* serve direction */
 	} data;
 };
 #pragma pack(pop)
 
+#define CMD_BLOCK 64 /* commands per block of the command log */
+#define CMD_TICK_SLOTS 64 /* initial per-tick table size, a power of two */
+
+struct cmd_entry
+{
+	struct cmd cmd;
+	struct cmd_entry *next; /* the next command on the same tick */
+};
+
+struct cmd_block
+{
+	struct cmd_block *next;
+	unsigned len;
+	struct cmd_entry entries[CMD_BLOCK];
+};
+
+/* One tick's commands.  Slots whose generation isn't the buffer's current
+   one are empty, which is how a clear empties the table without touching
+   it. */
+struct cmd_tick
+{
+	uint32_t generation;
+	uint32_t time;
+	struct cmd_entry *head;
+	struct cmd_entry *tail;
+};
+
+/*
+ * The command log.  Commands are appended to fixed size blocks, taken from
+ * the buffer's own freelist and only allocated when that runs dry, and are
+ * also chained per tick through an open addressed table so the simulation
+ * can find a tick's commands directly.  Clearing hands every block back to
+ * the freelist and bumps the generation, so both operations are O(1) and
+ * nothing is ever dropped for want of room.
+ */
 struct cmd_buf
 {
-	struct cmd *cmds;
+	struct cmd_block *head; /* in use, oldest first */
+	struct cmd_block *tail;
+	struct cmd_block *free;
 	unsigned len;
-	unsigned maxlen;
+	struct cmd_tick *ticks;
+	unsigned slots;
+	unsigned tick_count; /* distinct ticks this generation */
+	uint32_t generation;
+	unsigned reserved; /* blocks allocated up front */
+	unsigned blocks; /* blocks allocated in all */
+	unsigned peak; /* most commands held at once */
+	unsigned long grown; /* blocks allocated past the reserve */
+	unsigned long dropped; /* commands lost to a failed allocation */
 };
 
 #pragma pack(push, 4)
@@ -76,22 +365,462 @@ struct simple_packet
 	uint32_t type;
 };
 
+/* The opening SYN, with the session the joiner wants: one it has just made
+   up, or one it is coming back to */
+struct syn_packet
+{
+	uint32_t type;
+	uint32_t token;
+};
+
+/* NTP's four timestamps.  A PING carries the first, on the sender's own
+   clock, and the host fills in the other two from its game clock when it
+   echoes it back as a PONG; the fourth is when the PONG arrives. */
+struct clock_packet
+{
+	uint32_t type;
+	uint32_t seq;
+	uint32_t sent;
+	uint32_t host_recv;
+	uint32_t host_sent;
+	uint32_t rtt; /* the pinger's smoothed round trip, for lag compensation */
+	uint32_t received; /* snapshots the pinger has had, for rate control */
+};
+
+/* A four-client host's ACK, which says which paddle the joiner has; seat 0
+   is the host's own, so getting it means the game is full */
+struct seat_packet
+{
+	uint32_t type;
+	uint32_t seat;
+};
+
 struct cmd_packet
 {
 	uint32_t type;
 	struct cmd_net_buf buf;
 };
 
+/* The whole game, for the rare times a receiver has to be put right all
+   at once: a resume, a resync, a repeated SYN */
 struct update_packet
 {
 	uint32_t type;
 	struct gamestate state;
 };
+
+/* What is sent every frame: only what changes continuously.  The score
+   comes by event instead. */
+struct motion_packet
+{
+	uint32_t type;
+	uint32_t time;
+	struct player players[2];
+	struct ball ball;
+};
+
+/* Every input the sender has that the receiver hasn't acknowledged, so a
+   lost packet is covered by the next one.  Only count inputs are sent. */
+struct input_packet
+{
+	uint32_t type;
+	uint32_t first; /* tick of inputs[0] */
+	uint32_t ack; /* we have all of your inputs before this tick */
+	uint32_t hash_tick; /* the latest tick we've reached, and our state then */
+	uint64_t hash;
+	uint8_t delay;
+	uint8_t count;
+	uint8_t inputs[LOCKSTEP_MAX_INPUTS];
+};
+
+struct wire_ball
+{
+	scalar x, y;
+	scalar xv, yv;
+	uint32_t colliding;
+};
+
+/* Chaos mode's extra balls; the game's own ball still goes in the update */
+struct balls_packet
+{
+	uint32_t type;
+	uint32_t time;
+	uint32_t count;
+	struct wire_ball balls[1];
+};
+
+/* Something that happens at an instant rather than over time.  Each
+   carries the score after it, so having the latest is enough to be right. */
+struct game_event
+{
+	uint32_t seq;
+	uint32_t tick;
+	uint16_t type;
+	int16_t direction; /* a serve's or reset's */
+	uint16_t score[2];
+};
+
+/* Every event the receiver hasn't acknowledged, as far back as the log
+   goes.  Only count are sent. */
+struct events_packet
+{
+	uint32_t type;
+	uint32_t epoch; /* the host's, new every time it starts */
+	uint32_t count;
+	struct game_event events[EVENT_LOG];
+};
+
+struct event_ack_packet
+{
+	uint32_t type;
+	uint32_t next; /* we have every event before this */
+};
 #pragma pack(pop)
 
+enum
+{
+	EVENT_SCORE = 1,
+	EVENT_SERVE = 2,
+	EVENT_RESET = 3
+};
+
+/*
+ * The reliable channel for discrete events.  The host makes them as its
+ * game runs and keeps the latest EVENT_LOG, resending each receiver what
+ * it hasn't acknowledged.  Receivers keep the same log, numbered as the
+ * host's, which is all a relay needs to pass them on to its own.  Since
+ * snapshots no longer carry the score, receivers keep it from here.
+ */
+struct events
+{
+	struct gamestate *owner; /* the state they're made from, NULL unless hosting */
+	struct game_event log[EVENT_LOG];
+	uint32_t epoch; /* of the host the log came from */
+	uint32_t next; /* seq of the next to make, or that we're waiting for */
+	struct event_peer joiner; /* the classic pair's */
+	uint16_t score[2];
+	uint32_t tick; /* of the last one taken */
+	uint32_t motion; /* time of the last snapshot taken */
+	unsigned long resent; /* sends that weren't acknowledged in time */
+};
+
+struct rates
+{
+	uint32_t hz; /* what a healthy link gets, 0 to send every frame */
+	struct send_rate joiner; /* the classic pair's */
+	unsigned long backoffs;
+};
+
+enum
+{
+	INPUT_MINUS = 1,
+	INPUT_PLUS = 2,
+	INPUT_SERVE = 4
+};
+
+/* Both peers run the simulation and only trade inputs.  The input sampled
+   on tick t is applied on tick t + delay, which hides the trip to the other
+   side; a tick only runs once both players' inputs for it are in. */
+struct lockstep
+{
+	int active;
+	int me; /* player index, 0 for the host */
+	uint32_t delay;
+	uint32_t sim_tick; /* next tick to simulate */
+	uint32_t next_input; /* next tick to sample our own input for */
+	uint32_t have; /* we have the peer's inputs for every tick before this */
+	uint32_t peer_ack; /* the peer has ours for every tick before this */
+	int serve; /* serve pressed since the last sample */
+	Uint32 last_send;
+	uint32_t ticks[2][LOCKSTEP_WINDOW]; /* which tick each slot holds */
+	uint8_t inputs[2][LOCKSTEP_WINDOW];
+	struct statehash state; /* of local_state */
+	uint64_t hashes[LOCKSTEP_WINDOW]; /* of the state at the start of each tick */
+	uint32_t hash_ticks[LOCKSTEP_WINDOW];
+	uint64_t peer_hash; /* the peer's latest, kept until we get that far */
+	uint32_t peer_hash_tick;
+	int have_peer_hash;
+	int desync; /* the hashes differ and the host hasn't put us right yet */
+	Uint32 last_resync;
+};
+
+/*
+ * Chaos mode.  The gamestate keeps its one ball, which is what gets served
+ * and sent in updates as always; the rest only live here.  While stepping,
+ * balls[0] stands in for the owner's ball so they can all be treated alike.
+ * Touching pairs are found through a uniform grid over the field, rebuilt
+ * with a counting sort every step, so collisions stay close to linear in
+ * the number of balls.
+ */
+struct multiball
+{
+	struct gamestate *owner; /* NULL outside chaos mode */
+	struct ball *balls;
+	int count;
+	int cap;
+	int cols, rows;
+	int *cell_start; /* cols * rows + 1 offsets into order */
+	int *cell_of;
+	int *order; /* ball indices sorted by cell */
+	SDL_Rect *rects; /* for drawing them all in one call */
+	uint32_t launches; /* picks the next launch direction */
+	uint32_t newest; /* time of the last PACKET_BALLS taken */
+};
+
+struct clock_sample
+{
+	int32_t offset;
+	uint32_t rtt;
+};
+
+/*
+ * Where the host's game clock is relative to our SDL_GetTicks(), so
+ * commands can be stamped, and the game predicted, on the host's timeline.
+ * Of the last few samples the one with the quickest round trip wins, since
+ * uneven delay in the two directions can only put its offset out by half
+ * its round trip.  The round trip itself is also smoothed, TCP style.
+ */
+struct timesync
+{
+	struct clock_sample samples[CLOCK_SAMPLES];
+	int count; /* samples taken, the window holds the last CLOCK_SAMPLES */
+	int32_t offset;
+	uint32_t rtt; /* of the sample the offset came from */
+	uint32_t srtt;
+	uint32_t seq;
+	Uint32 last_ping;
+	uint32_t received; /* snapshots taken */
+	unsigned long late; /* remote commands the host had to move on */
+	unsigned long early;
+};
+
+/* Where the ball was after one physics step */
+struct ball_history
+{
+	uint32_t tick;
+	scalar x, y;
+	scalar xv, yv;
+};
+
+/*
+ * Lag compensation on the host.  A remote player's moves get here half a
+ * round trip after they made them, by which time the ball has moved on, so
+ * their paddle is also checked against where the ball was back then.  If
+ * the two touched, and the ball is still heading for their wall, they get
+ * the bounce they saw.  The host's copy of a remote paddle already runs
+ * that far behind, so only the ball needs a history: a small ring with one
+ * entry per physics step, indexed by tick.
+ */
+struct lagcomp
+{
+	struct gamestate *owner; /* the host's game, NULL when off */
+	uint32_t max_ms;
+	uint32_t rewind[4]; /* ms per paddle, in sweep_ball's order; 0 for ours */
+	struct ball_history history[LAGCOMP_HISTORY];
+	unsigned long saves; /* hits only the rewind caught */
+};
+
+/* A joiner in four-client mode.  Each has its own queue of packets waiting
+   to go, so one that can't keep up only ever loses its own oldest ones. */
+struct seat
+{
+	IPaddress addr;
+	int taken;
+	int live; /* heard from since its ACK, and not gone quiet since */
+	Uint32 last_heard;
+	uint32_t token; /* its session, 0 if it didn't send one */
+	struct event_peer ev;
+	struct send_rate rate;
+	struct snapshot *queue[SEAT_QUEUE]; /* oldest first */
+	int queued;
+	unsigned long dropped;
+};
+
+struct seats
+{
+	int count; /* paddles in play, 0 outside four-client mode */
+	struct seat list[SEATS]; /* list[0] is the host's own */
+	UDPpacket packets[SEATS * SEAT_QUEUE];
+	UDPpacket *vec[SEATS * SEAT_QUEUE];
+};
+
+/*
+ * A joiner's claim on its paddle.  The joiner makes the token up and sends
+ * it with its SYN, and a later SYN with the same token, from wherever,
+ * takes the paddle back.  This is the classic pair's; four-client hosts
+ * keep a token per seat.  Both ends watch for the other going quiet: the
+ * host stops sending into the void and the joiner starts knocking.
+ */
+struct session
+{
+	uint32_t token;
+	Uint32 last_heard; /* from the other end */
+	Uint32 last_knock; /* joiner: when it last asked to resume */
+	int lost;
+};
+
+#define REPLAY_DICT_SIZE 16
+
+/* One command of a recording, as the replay encoder sees it */
+struct replay_step
+{
+	uint32_t delta; /* ticks since the previous command or keyframe */
+	uint32_t type;
+	uint32_t data;
+};
+
+/* Match recording.  The game thread encodes records into a pending buffer
+   and the writer thread swaps it out and does the actual disk I/O, so the
+   game loop never waits on the file. */
+struct replay_writer
+{
+	FILE *file;
+	SDL_Thread *thread;
+	SDL_mutex *lock;
+	SDL_cond *wake;
+	int active;
+	int stopping;
+
+	uint8_t *pending; /* game thread fills this... */
+	unsigned pending_len;
+	unsigned pending_cap;
+	uint8_t *out; /* ...writer thread drains this */
+	unsigned out_len;
+	unsigned out_cap;
+
+	uint32_t offset; /* file offset of the next record */
+	uint32_t last_tick;
+	uint32_t keyframe_ms;
+
+	/* Command compression state, reset at every keyframe */
+	struct replay_step dict[REPLAY_DICT_SIZE];
+	unsigned dict_len;
+	unsigned dict_next;
+	struct replay_step hist[2]; /* hist[0] is the latest command */
+	unsigned hist_len;
+	unsigned run_period;
+	uint32_t run_count;
+
+	uint32_t *index; /* (tick, offset) pairs, one per keyframe */
+	unsigned index_len;
+	unsigned index_cap;
+};
+
+struct mapped_file
+{
+	const uint8_t *data;
+	uint32_t len;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+/* A replay opened for playback.  The file is mapped rather than read, so
+   opening an hour-long match costs nothing until we touch part of it. */
+struct replay
+{
+	struct mapped_file map;
+	uint32_t keyframe_ms;
+	uint32_t step; /* physics step it was recorded with */
+	uint32_t end_tick;
+	uint32_t *index; /* (tick, offset) pairs, sorted by tick */
+	unsigned keyframes;
+};
+
+/* Where playback has got to in a replay's record stream */
+struct replay_cursor
+{
+	uint32_t offset;
+	uint32_t last_tick;
+	struct cmd_buf *buf;
+
+	/* Mirrors the recorder's compression state */
+	struct replay_step dict[REPLAY_DICT_SIZE];
+	unsigned dict_len;
+	unsigned dict_next;
+	struct replay_step hist[2];
+	unsigned hist_len;
+	unsigned run_period;
+	uint32_t run_left;
+
+	/* The last keyframe read came from outside the command stream */
+	int out_of_band;
+};
+
+/* One side of a bisection: a replay, and whether its states are the ones
+   it recorded or what re-simulating its commands up to them gives */
+struct bisect_side
+{
+	struct replay *r;
+	struct replay_cursor c;
+	const char *name;
+	int resim;
+};
+
+/* One recording for the verifier, and what re-simulating it came to */
+struct verify_job
+{
+	char *path;
+	int result;
+	uint32_t len;
+	uint32_t ticks; /* simulated */
+	uint32_t checked; /* keyframes compared */
+	uint32_t tick; /* of the first that didn't match */
+	struct gamestate want;
+	struct gamestate got;
+};
+
+/* A worker's share of the jobs, from next up to end.  The owner takes from
+   the front and anyone who has run out steals the back half. */
+struct verify_queue
+{
+	SDL_mutex *lock;
+	int next;
+	int end;
+};
+
+struct verify_worker
+{
+	struct verify_job *jobs;
+	struct verify_queue *queues;
+	int count;
+	int id;
+	unsigned stolen;
+	SDL_Thread *thread;
+};
+
+/* A headless player for load testing.  Bots are cheap enough that one
+   process can run hundreds, each on its own socket. */
+struct bot
+{
+	struct net net;
+	struct gamestate state;
+	uint32_t opener; /* PACKET_SYN for the real joiner, else PACKET_SPECTATE */
+	Uint32 started; /* when we first sent the opener */
+	Uint32 sent; /* last opener or keepalive */
+	Uint32 last_ping;
+	Uint32 next_think;
+	int target; /* where we want the paddle's centre */
+	uint32_t seed;
+	unsigned updates;
+	unsigned cmds;
+	int32_t clock_base; /* smallest arrival time minus state time seen */
+	int have_base;
+};
+
+/* Update ages collected by the load generator over one step of the ramp */
+struct latency_log
+{
+	uint32_t *ages;
+	unsigned len;
+	unsigned cap;
+	unsigned long bytes;
+};
+
 int init();
 int net_init();
-void net_wait_for_game( struct net *pnet );
+int net_wait_for_game( struct net *pnet );
 void quit();
 void input( SDL_Event );
 void local_loop();
@@ -101,20 +830,179 @@ void init_gamestate( struct gamestate *g );
 void render_gamestate( struct gamestate *g );
 void white_rect( SDL_Rect * );
 void reset_ball( struct ball *pball );
-void handle_ball( struct ball *pball, struct player *p1p, struct player *p2p );
+void paddle_rects( const struct gamestate *gs, SDL_Rect paddles[4] );
+void ball_rect( const struct ball *pball, SDL_Rect *r );
+void handle_ball( struct ball *pball, uint16_t score[2] );
+void bounce_ball( struct ball *pball, SDL_Rect *p );
+void sweep_ball( struct ball *pball, SDL_Rect paddles[4], uint32_t ms );
+void sweep_axis( scalar pos, scalar move, int lo, int hi, scalar *enter, scalar *leave );
+scalar sweep_time( scalar dist, scalar move );
+#ifdef FIXED_PHYSICS
+uint32_t isqrt64( uint64_t n );
+#endif
 struct cmd_buf *init_cmd_buf( unsigned size );
 void free_cmd_buf( struct cmd_buf *p );
-void player_move_cmd( struct cmd *out, int type, float offset );
+void player_move_cmd( struct cmd *out, int type, scalar offset );
 int add_to_cmd_buf( struct cmd_buf *buf, struct cmd cmd );
 void clear_cmd_buf( struct cmd_buf *p );
 struct cmd_net_buf *cmd_to_net( struct cmd_buf *in );
+struct cmd_entry *cmd_buf_tick( struct cmd_buf *buf, uint32_t time );
+struct cmd_tick *cmd_buf_slot( struct cmd_buf *buf, uint32_t time );
+int cmd_buf_grow_ticks( struct cmd_buf *buf );
 void advance_gamestate( uint32_t start, uint32_t duration, uint32_t timestep, struct gamestate *gs, struct cmd_buf *buf );
 int net_bind( struct net * );
-int net_recv( struct net *pnet, void *outbuf, int buflen, int *outlen, IPaddress *ip );
+int net_recv( struct net *pnet, struct packet_view *v );
+const struct update_packet *packet_update( const struct packet_view *v );
+const struct motion_packet *packet_motion( const struct packet_view *v );
+const struct events_packet *packet_events( const struct packet_view *v );
+const struct event_ack_packet *packet_event_ack( const struct packet_view *v );
+const struct cmd_packet *packet_cmds( const struct packet_view *v );
+const struct input_packet *packet_input( const struct packet_view *v );
+const struct balls_packet *packet_balls( const struct packet_view *v );
+const struct clock_packet *packet_clock( const struct packet_view *v );
+const struct syn_packet *packet_syn( const struct packet_view *v );
 int net_send( struct net *pnet, void *inbuf, int inlen, IPaddress to );
 int net_simple_packet( struct net *pnet, struct simple_packet* packet, IPaddress to );
 /*int net_thread( void * );*/
 int net_send_update( struct net *pnet, IPaddress to, struct gamestate *gs );
+struct snapshot *snapshot_new( const void *data, int len );
+struct snapshot *snapshot_motion( struct gamestate *gs );
+void update_apply( const struct update_packet *up, struct gamestate *gs );
+void motion_apply( const struct motion_packet *mp, struct gamestate *gs );
+void events_push( int type, uint32_t tick, int direction, const struct gamestate *gs );
+int events_send( struct net *pnet, struct event_peer *p, IPaddress to );
+void events_flush( struct net *pnet );
+void events_recv( struct net *pnet, const struct packet_view *v, struct gamestate *gs );
+void events_restart( uint32_t epoch );
+struct event_peer *events_peer( IPaddress from );
+void events_acked( struct event_peer *p, const struct packet_view *v );
+void rates_frame( int joiner_live );
+int rate_due( struct send_rate *r, Uint32 now );
+struct send_rate *rate_find( IPaddress from );
+void rate_report( struct send_rate *r, const struct clock_packet *ping );
+void snapshot_ref( struct snapshot *snap );
+void snapshot_unref( struct snapshot *snap );
+void spectator_packet( struct net *pnet, struct spectators *sp, uint32_t type, IPaddress from );
+void spectators_expire( struct spectators *sp );
+int spectators_send( struct net *pnet, struct spectators *sp, struct snapshot *snap );
+void spectator_loop();
+void relay_loop();
+void lockstep_init( int me, uint32_t delay );
+void lockstep_loop();
+void lockstep_sample( uint32_t now_tick );
+void lockstep_send();
+void lockstep_recv( const struct input_packet *in );
+void lockstep_cmds( uint32_t tick, struct cmd_buf *buf );
+void lockstep_hash( uint32_t tick );
+void lockstep_check();
+void lockstep_resync( const struct update_packet *up );
+void statehash_init( struct statehash *sh );
+uint64_t statehash_update( struct statehash *sh, const struct gamestate *gs );
+uint64_t statehash_word( uint32_t i, uint32_t w );
+uint64_t statehash_of( const struct gamestate *gs );
+void multiball_init( struct gamestate *owner, int count );
+void multiball_reserve( int count );
+void multiball_launch( struct ball *pball, uint32_t n );
+void multiball_step( struct gamestate *gs, uint32_t ms );
+void multiball_collide();
+void multiball_bounce( struct ball *a, struct ball *b );
+void multiball_render();
+void multiball_recv( const struct balls_packet *bp );
+struct snapshot *snapshot_balls( uint32_t time );
+void paddle_move_cmd( int paddle, struct cmd_buf *buf );
+int seat_find( IPaddress from );
+int seats_recv( struct net *pnet, const struct packet_view *v, struct cmd_buf *buf );
+void seats_expire();
+void seats_queue( struct snapshot *snap );
+int seats_flush( struct net *pnet );
+void remote_cmd( struct cmd_buf *buf, struct cmd c );
+void timesync_ping( struct net *pnet );
+void timesync_pong( struct net *pnet, const struct packet_view *v );
+void timesync_recv( const struct clock_packet *cp );
+uint32_t timesync_now();
+void lagcomp_rtt( IPaddress from, uint32_t rtt );
+int lagcomp_step( struct gamestate *gs, uint32_t tick, uint32_t step );
+const struct ball_history *lagcomp_at( uint32_t tick, uint32_t step );
+int lagcomp_touching( const struct ball_history *h, SDL_Rect *paddle );
+int lagcomp_toward( int paddle, scalar xv, scalar yv );
+uint32_t session_token();
+void session_heard( IPaddress from );
+int session_check( struct net *pnet );
+void session_resume( struct net *pnet, const struct packet_view *v );
+int session_ack( struct net *pnet, const struct packet_view *v );
+int resolve_addr( IPaddress *addr, const char *spec );
+int bot_main( int argc, char **argv );
+int bot_init( struct bot *b, IPaddress host, int i );
+void bot_loop( struct bot *bots, int count, int skill, int reaction );
+int bots_step( struct bot *bots, int count, int skill, int reaction, Uint32 now, Uint32 dt, struct latency_log *lat );
+void bot_recv( struct bot *b, struct latency_log *lat );
+void bot_think( struct bot *b, int skill );
+void bot_move( struct bot *b, Uint32 dt );
+int predict_intercept( struct gamestate *gs, int *x );
+uint32_t bot_rand( uint32_t *seed );
+int loadgen_main( int argc, char **argv );
+void latency_add( struct latency_log *lat, uint32_t age );
+uint32_t latency_percentile( struct latency_log *lat, unsigned permille );
+int compare_u32( const void *a, const void *b );
+const char *get_option( int argc, char **argv, const char *name );
+int tool_exit( int status );
+void timers_init( Uint32 interval );
+void timer_start( int phase );
+void timer_stop( int phase );
+void timers_frame();
+void timers_dump( int final );
+void histogram_add( struct histogram *h, uint64_t value );
+void histogram_merge( struct histogram *into, struct histogram *from );
+uint64_t histogram_percentile( struct histogram *h, unsigned percent );
+void trace_init( const char *path );
+struct trace_thread *trace_register( const char *name );
+void trace_event( const char *name, int ph, int arg );
+void trace_write();
+int impair_init( int argc, char **argv );
+int impair_chance( double percent );
+int impair_send( UDPsocket socket, const void *data, int len, IPaddress to );
+void impair_enqueue( UDPsocket socket, const void *data, int len, IPaddress to, Uint32 due );
+int impair_before( struct impaired_packet *a, struct impaired_packet *b );
+void impair_flush();
+int replay_start( const char *path, uint32_t keyframe_ms );
+void replay_stop( struct gamestate *gs );
+void replay_cmd( uint32_t tick, struct cmd *c );
+void replay_keyframe( struct gamestate *gs, uint32_t tick, int out_of_band );
+void replay_end_run();
+int replay_step_equal( struct replay_step *a, struct replay_step *b );
+void replay_push_step( struct replay_step *hist, unsigned *len, struct replay_step *step );
+void replay_put( const void *data, unsigned len );
+void replay_put_u8( uint8_t v );
+void replay_put_u32( uint32_t v );
+void replay_put_varint( uint32_t v );
+void replay_flush( int force );
+int replay_writer_thread( void *ptr );
+int map_file( const char *path, struct mapped_file *m );
+void unmap_file( struct mapped_file *m );
+uint32_t get_u32( const uint8_t *p );
+int replay_open( struct replay *r, const char *path );
+void replay_close( struct replay *r );
+int replay_scan_index( struct replay *r );
+void replay_cursor_reset( struct replay_cursor *c, uint32_t offset, uint32_t tick );
+int replay_read( struct replay *r, struct replay_cursor *c, struct cmd *cmd, uint32_t *tick );
+int replay_get_varint( struct replay *r, uint32_t *off, uint32_t *v );
+unsigned replay_find_keyframe( struct replay *r, uint32_t tick );
+void replay_seek( struct replay *r, struct replay_cursor *c, uint32_t tick, struct gamestate *gs );
+int replay_advance( struct replay *r, struct replay_cursor *c, uint32_t tick, struct gamestate *gs );
+int replay_main( int argc, char **argv );
+void replay_loop( struct replay *r, uint32_t tick, int speed );
+int replay_export( struct replay *r, uint32_t tick, const char *path );
+int bisect_main( int argc, char **argv );
+void bisect_state( struct bisect_side *s, uint32_t tick, struct gamestate *gs );
+uint32_t bisect_ticks( struct bisect_side *s, struct bisect_side *other, uint32_t tick, uint32_t to, struct gamestate *ga, struct gamestate *gb );
+void bisect_diff( const struct gamestate *a, const struct gamestate *b, const char *name_a, const char *name_b );
+void bisect_field( const char *name, double a, double b );
+int verify_main( int argc, char **argv );
+int verify_list( const char *dir, struct verify_job **jobs );
+int verify_compare_jobs( const void *a, const void *b );
+int verify_thread( void *ptr );
+int verify_take( struct verify_worker *w );
+void verify_replay( struct verify_job *job, struct cmd_buf *buf );
 
 const char *WINDOW_TITLE = "Pong";
 const int WIN_WIDTH = 640;
@@ -130,7 +1018,9 @@ enum
 {
 	NET_LOCAL = 1,
 	NET_HOST = 2,
-	NET_JOIN = 3
+	NET_JOIN = 3,
+	NET_SPECTATE = 4,
+	NET_RELAY = 5
 };
 
 enum
@@ -139,7 +1029,62 @@ enum
 	PACKET_ACK = 2,
 	PACKET_SYNACK = 3,
 	PACKET_UPDATE = 4,
-	PACKET_CMD = 5
+	PACKET_CMD = 5,
+	PACKET_SPECTATE = 6,
+	PACKET_INPUT = 7,
+	PACKET_BALLS = 8,
+	PACKET_PING = 9,
+	PACKET_PONG = 10,
+	PACKET_RESYNC = 11,
+	PACKET_MOTION = 12,
+	PACKET_EVENTS = 13,
+	PACKET_EVENT_ACK = 14
+};
+
+#define HANDSHAKE_RETRY 500
+#define CLOCK_PING_MS 250
+#define CLOCK_BURST_MS 50 /* until the filter's window is full */
+#define SPECTATE_INTERVAL 1000
+#define SPECTATOR_TIMEOUT 5000
+#define PEER_TIMEOUT 1000 /* silence before a host stops sending to a joiner */
+#define SESSION_TIMEOUT 60000 /* how long a four-client seat is held for its player */
+#define RESUME_AFTER 500 /* silence before a joiner asks the host to resume */
+#define EVENT_RETRY 100 /* between resends of unacknowledged events */
+#define RATE_DEFAULT_HZ 60
+#define RATE_MIN_HZ 10
+#define RATE_STEP_HZ 10 /* added for each healthy verdict */
+#define RATE_SAMPLE 20 /* snapshots sent before a loss figure means anything */
+#define RATE_LOSS_PERCENT 10 /* more than this lost halves the rate */
+#define RATE_QUEUE_MS 40 /* round trip this far over the best seen halves it too */
+#define RATE_HOLD_MS 2000 /* for the last halving to show in the pings' smoothed round trip */
+#define RELAY_STATS_INTERVAL 5000
+#define RELAY_RESTART_MS 5000 /* an update this far behind means upstream started over */
+#define BOT_JOIN_TIMEOUT 2000
+#define BOT_LOOKAHEAD 3000
+#define BOT_DEADZONE 4
+#define LOADGEN_STEP 10000
+#define IMPAIR_REORDER_MS 20 /* how far a reordered packet falls behind */
+#define IMPAIR_QUEUE_MS 1000 /* backlog a rate capped link holds before dropping */
+
+#define REPLAY_MAGIC "PRPL"
+#define REPLAY_INDEX_MAGIC "PIDX"
+#define REPLAY_VERSION 2
+#define REPLAY_FLUSH_SIZE 4096
+#define REPLAY_HEADER_SIZE 20
+#define REPLAY_MAX_SPEED 64
+#define REPLAY_SKIP_MS 10000
+#define REC_OUT_OF_BAND 0x10 /* flag in a keyframe's type byte */
+#define VERIFY_MAX_THREADS 256
+#define REPLAY_EXPORT_MS 100
+
+enum
+{
+	REC_CMD = 1,
+	REC_KEYFRAME = 2,
+	REC_END = 3,
+	REC_INDEX = 4,
+	REC_CMD_REF = 5,
+	REC_RUN = 6
 };
 
 enum
@@ -155,7 +1100,11 @@ enum
 	CMD_PLAYER1_MOVE = 1,
 	CMD_PLAYER1_SERVE = 2,
 	CMD_PLAYER2_MOVE = 3,
-	CMD_PLAYER2_SERVE = 4
+	CMD_PLAYER2_SERVE = 4,
+	CMD_PADDLE1_MOVE = 5, /* four-client mode, in sweep_ball's paddle order */
+	CMD_PADDLE2_MOVE = 6,
+	CMD_PADDLE3_MOVE = 7,
+	CMD_PADDLE4_MOVE = 8
 };
 
 SDL_Window *window;
@@ -168,6 +1117,22 @@ int input_status[4];
 struct net net;
 struct gamestate local_state;
 struct cmd_buf *local_cmd_buf;
+struct replay_writer recorder;
+struct spectators spectators;
+struct impairment impair;
+struct timers timers;
+struct tracer tracer;
+struct lockstep lockstep;
+struct multiball multiball;
+struct seats seats;
+struct timesync timesync;
+struct lagcomp lagcomp;
+struct session session;
+struct events events;
+struct rates rates;
+uint32_t physics_step = 10; /* ms between ball moves */
+THREAD_LOCAL struct trace_thread *trace_self;
+const char *phase_names[PHASE_COUNT] = { "poll", "recv", "cmds", "advance", "render", "present", "send", "frame" };
 
 int init()
 {
@@ -192,80 +1157,114 @@ int net_init()
 		printf( "Could not bind to port!\n" );
 		return 0;
 	}
+
+	return 1;
 }
 
-/* Should be called after a socket has been created */
-void net_wait_for_game( struct net *pnet )
+/* Should be called after a socket has been created.  Returns 0 if the
+   host turned us away. */
+int net_wait_for_game( struct net *pnet )
 {
-	uint8_t buf[MAXPACKETSIZE];
-	int buflen = MAXPACKETSIZE;
-	int recvbytes;
-	IPaddress ip;
-	struct simple_packet *sp;
-	struct simple_packet syn_packet;
+	struct packet_view v;
+	const struct syn_packet *syn;
+	struct syn_packet syn_packet;
 	struct simple_packet ack_packet;
 	struct simple_packet synack_packet;
+	Uint32 sent;
 
 	syn_packet.type = PACKET_SYN;
+	syn_packet.token = pnet->type == NET_JOIN ? session.token : 0;
 	ack_packet.type = PACKET_ACK;
 	synack_packet.type = PACKET_SYNACK;
 
-	if( pnet->type == NET_JOIN )
+	/* Spectators open with their own packet but otherwise shake hands the
+	   same way a joining player does */
+	if( pnet->type == NET_SPECTATE || pnet->type == NET_RELAY )
 	{
-		net_simple_packet( pnet, &syn_packet, pnet->addr );
+		syn_packet.type = PACKET_SPECTATE;
+	}
+
+	if( pnet->type == NET_JOIN || pnet->type == NET_SPECTATE || pnet->type == NET_RELAY )
+	{
+		net_send( pnet, &syn_packet, sizeof(syn_packet), pnet->addr );
 		pnet->state = NET_STATE_WAIT_ACK;
 	}
+	else if( pnet->type == NET_HOST && seats.count )
+	{
+		/* Four-client hosts seat joiners as they turn up, in the game loop */
+		pnet->state = NET_STATE_GAME;
+		return 1;
+	}
 	else if( pnet->type == NET_HOST )
 	{
 		pnet->state = NET_STATE_WAIT_SYN;
 	}
 	else
 	{
-		return;
+		return 1;
 	}
 
 
+	sent = SDL_GetTicks();
+
 	while( pnet->state != NET_STATE_GAME )
 	{
-		if( !net_recv( pnet, (void*)buf, buflen, &recvbytes, &ip ) )
+		if( !net_recv( pnet, &v ) )
 		{
+			/* Either side of the opening exchange may have been lost */
+			if( pnet->state == NET_STATE_WAIT_ACK && SDL_GetTicks() - sent > HANDSHAKE_RETRY )
+			{
+				net_send( pnet, &syn_packet, sizeof(syn_packet), pnet->addr );
+				sent = SDL_GetTicks();
+			}
 			continue;
 		}
 
-		sp = (struct simple_packet*)buf;
-
 		switch( pnet->state )
 		{
 		case NET_STATE_WAIT_SYN:
-			if( sp->type == PACKET_SYN )
+		case NET_STATE_WAIT_SYNACK:
+			if( v.type == PACKET_SYN )
 			{
 				printf( "SYN received, sending ACK\n" );
-				pnet->addr.host = ip.host;
+				pnet->addr = v.from;
+				syn = packet_syn( &v );
+				session.token = syn ? syn->token : 0;
 				net_simple_packet( pnet, &ack_packet, pnet->addr );
 				pnet->state = NET_STATE_WAIT_SYNACK;
 			}
-			break;
-		case NET_STATE_WAIT_ACK:
-			if( sp->type == PACKET_ACK )
+			else if( pnet->state == NET_STATE_WAIT_SYNACK && ( v.type == PACKET_SYNACK || v.type == PACKET_INPUT ) )
 			{
-				printf( "ACK received, sending SYNACK\n" );
-				net_simple_packet( pnet, &synack_packet, pnet->addr );
+				/* A lockstep peer's first inputs mean it got our ACK */
+				printf( "Got SYNACK\n" );
 				pnet->state = NET_STATE_GAME;
 			}
 			break;
-		case NET_STATE_WAIT_SYNACK:
-			if( sp->type == PACKET_SYNACK )
+		case NET_STATE_WAIT_ACK:
+			if( v.type == PACKET_ACK && v.len >= (int)sizeof(struct seat_packet) && pnet->type == NET_JOIN )
 			{
-				printf( "Got SYNACK\n" );
+				pnet->seat = ((const struct seat_packet*)v.data)->seat;
+				if( pnet->seat == 0 || pnet->seat >= SEATS )
+				{
+					printf( "The game is full\n" );
+					return 0;
+				}
+				printf( "Playing paddle %d\n", pnet->seat + 1 );
+			}
+
+			if( v.type == PACKET_ACK )
+			{
+				printf( "ACK received, sending SYNACK\n" );
+				net_simple_packet( pnet, &synack_packet, pnet->addr );
 				pnet->state = NET_STATE_GAME;
 			}
 			break;
 		default:
 			break;
 		}
-
-		memset( buf, 0, MAXPACKETSIZE );
 	}
+
+	return 1;
 }
 
 void quit()
@@ -330,10 +1329,22 @@ void input( SDL_Event event )
 			input_status[2] = 0;
 		}
 
-		if( event.key.keysym.sym == SDLK_r )
+		if( event.key.keysym.sym == SDLK_r && lockstep.active )
+		{
+			/* Both sides have to serve on the same tick */
+			lockstep.serve = 1;
+		}
+		else if( event.key.keysym.sym == SDLK_r )
 		{
 			reset_ball( &local_state.ball );
-			local_state.ball.xv = -BALL_SPEED;
+			local_state.ball.xv = INT_TO_SCALAR( -BALL_SPEED );
+
+			/* This happens outside the command stream, so a replay has to
+			   pick it up from a keyframe */
+			replay_keyframe( &local_state, local_state.time, 1 );
+
+			if( events.owner == &local_state )
+				events_push( EVENT_RESET, local_state.time, -1, &local_state );
 		}
 
 		break;
@@ -342,673 +1353,5823 @@ void input( SDL_Event event )
 
 void client_loop()
 {
-	uint8_t buf[MAXPACKETSIZE];
-	int buflen = MAXPACKETSIZE;
-	int recvbytes;
-	IPaddress ip;
-	struct update_packet *up;
+	struct packet_view v;
+	const struct update_packet *up;
+	const struct motion_packet *mp;
+	const struct balls_packet *bp;
+	const struct clock_packet *ck;
 	struct cmd tc;
 	SDL_Event event;
 	Uint32 ticks = SDL_GetTicks();
 	start_time = ticks;
+	session.last_heard = ticks;
 
 	local_cmd_buf = init_cmd_buf( 0xFFF );
 
 	while( running )
 	{
+		timer_start( PHASE_FRAME );
+		timer_start( PHASE_POLL );
 		while( SDL_PollEvent( &event ) )
 		{
 			input( event );
 		}
+		timer_stop( PHASE_POLL );
 
-		if( net_recv( &net, (void*)buf, buflen, &recvbytes, &ip ) && ((struct simple_packet*)buf)->type == PACKET_UPDATE )
+		/* Drained, since chaos mode sends two packets a frame.  Whatever
+		   the host sends after we've resumed, its next update is the whole
+		   game, which the advance below brings up to now. */
+		timer_start( PHASE_RECV );
+		while( net_recv( &net, &v ) )
 		{
-			up = (struct update_packet*)buf;
-			local_state = up->state;
-		}
+			session_heard( v.from );
 
-	  	/*if( input_status[0] )
-		{
-			player_move_cmd( &tc, CMD_PLAYER1_MOVE, -PADDLE_SPEED * ( delta / 1000.f ) );
-			add_to_cmd_buf( local_cmd_buf, tc );
-		}
-		
-		if( input_status[1] )
-		{
-			player_move_cmd( &tc, CMD_PLAYER1_MOVE, PADDLE_SPEED * ( delta / 1000.f ) );
-			add_to_cmd_buf( local_cmd_buf, tc );
-		}*/
-			
-		if( input_status[3] )
+			if( v.type == PACKET_ACK && !session_ack( &net, &v ) )
+			{
+				running = 0;
+			}
+			else if( ( mp = packet_motion( &v ) ) != NULL )
+			{
+				motion_apply( mp, &local_state );
+			}
+			else if( v.type == PACKET_EVENTS )
+			{
+				events_recv( &net, &v, &local_state );
+			}
+			else if( ( up = packet_update( &v ) ) != NULL )
+			{
+				update_apply( up, &local_state );
+			}
+			else if( ( bp = packet_balls( &v ) ) != NULL )
+			{
+				multiball_recv( bp );
+			}
+			else if( ( ck = packet_clock( &v ) ) != NULL )
+			{
+				timesync_recv( ck );
+			}
+		}
+		session_check( &net );
+		timer_stop( PHASE_RECV );
+
+		timer_start( PHASE_CMDS );
+
+	  	/*if( input_status[0] )
 		{
-			player_move_cmd( &tc, CMD_PLAYER2_MOVE, -PADDLE_SPEED * ( delta / 1000.f ) );
+			player_move_cmd( &tc, CMD_PLAYER1_MOVE, SCALAR_PER_MS( INT_TO_SCALAR( -PADDLE_SPEED ), delta ) );
 			add_to_cmd_buf( local_cmd_buf, tc );
 		}
 		
-		if( input_status[2] )
+		if( input_status[1] )
 		{
-			player_move_cmd( &tc, CMD_PLAYER2_MOVE, PADDLE_SPEED * ( delta / 1000.f ) );
+			player_move_cmd( &tc, CMD_PLAYER1_MOVE, SCALAR_PER_MS( INT_TO_SCALAR( PADDLE_SPEED ), delta ) );
 			add_to_cmd_buf( local_cmd_buf, tc );
+		}*/
+			
+		if( net.seat )
+		{
+			paddle_move_cmd( net.seat, local_cmd_buf );
 		}
-		
+		else
+		{
+			if( input_status[3] )
+			{
+				player_move_cmd( &tc, CMD_PLAYER2_MOVE, SCALAR_PER_MS( INT_TO_SCALAR( -PADDLE_SPEED ), delta ) );
+				add_to_cmd_buf( local_cmd_buf, tc );
+			}
+
+			if( input_status[2] )
+			{
+				player_move_cmd( &tc, CMD_PLAYER2_MOVE, SCALAR_PER_MS( INT_TO_SCALAR( PADDLE_SPEED ), delta ) );
+				add_to_cmd_buf( local_cmd_buf, tc );
+			}
+		}
+		timer_stop( PHASE_CMDS );
+
+		timer_start( PHASE_SEND );
 		net_send_cmd_buf( &net, net.addr, local_cmd_buf );
+		timesync_ping( &net );
+		timer_stop( PHASE_SEND );
 
+		/* Our own clock means nothing to the host, so until we know where
+		   its clock is we only show what it sends */
+		current_time = timesync.count ? timesync_now() : local_state.time;
+
+		timer_start( PHASE_ADVANCE );
 		if( local_state.time < current_time )
 		{
-			advance_gamestate( local_state.time, current_time - local_state.time, 10, &local_state, local_cmd_buf );
+			advance_gamestate( local_state.time, current_time - local_state.time, physics_step, &local_state, local_cmd_buf );
 		}
-		else
-			advance_gamestate( local_state.time, delta, 10, &local_state, local_cmd_buf );
+		timer_stop( PHASE_ADVANCE );
 
 		clear_cmd_buf( local_cmd_buf );
 
+		timer_start( PHASE_RENDER );
 		SDL_RenderClear( renderer );
 
 		render_gamestate( &local_state );
+		timer_stop( PHASE_RENDER );
 
+		timer_start( PHASE_PRESENT );
 		SDL_RenderPresent( renderer );
+		timer_stop( PHASE_PRESENT );
 
 		delta = SDL_GetTicks() - ticks;
-		current_time = SDL_GetTicks() - start_time;
-		local_state.time = current_time;
 		ticks = SDL_GetTicks();
+		timers_frame();
 	}
 }
 
 void server_loop()
 {
-	uint8_t buf[MAXPACKETSIZE];
-	int buflen = MAXPACKETSIZE;
-	int recvbytes;
-	IPaddress ip;
-	struct cmd_packet *cp;
+	struct packet_view v;
+	const struct cmd_packet *cp;
 	struct cmd tc;
+	struct snapshot *snap;
 	SDL_Event event;
-	int i;
+	int i, peer_live, joiner_due;
 	Uint32 ticks = SDL_GetTicks();
 	start_time = ticks;
+	session.last_heard = ticks;
 
 	local_cmd_buf = init_cmd_buf( 0xFFF );
 
 	while( running )
 	{
+		timer_start( PHASE_FRAME );
+		timer_start( PHASE_POLL );
 		while( SDL_PollEvent( &event ) )
 		{
 			input( event );
 		}
+		timer_stop( PHASE_POLL );
 
-		if( net_recv( &net, (void*)buf, buflen, &recvbytes, &ip ) && ((struct simple_packet*)buf)->type == PACKET_CMD )
+		/* Drain everything, spectator traffic mustn't hold up commands */
+		timer_start( PHASE_RECV );
+		while( net_recv( &net, &v ) )
 		{
-			cp = (struct cmd_packet*)buf;
-			for( i = 0; i < cp->buf.len; i++ )
+			if( seats.count && seats_recv( &net, &v, local_cmd_buf ) )
+				continue;
+
+			if( !seats.count )
+				session_heard( v.from );
+
+			switch( v.type )
 			{
-				add_to_cmd_buf( local_cmd_buf, cp->buf.cmds[i] );
+			case PACKET_SYN:
+				if( !seats.count )
+					session_resume( &net, &v );
+				break;
+
+			/* Only the joiner has a say, and only over its own paddle;
+			   spectators just watch */
+			case PACKET_CMD:
+				if( v.from.host != net.addr.host || v.from.port != net.addr.port )
+					break;
+				cp = packet_cmds( &v );
+				for( i = 0; cp != NULL && i < (int)cp->buf.len; i++ )
+				{
+					if( cp->buf.cmds[i].type == CMD_PLAYER2_MOVE )
+						remote_cmd( local_cmd_buf, cp->buf.cmds[i] );
+				}
+				break;
+
+			case PACKET_PING:
+				timesync_pong( &net, &v );
+				break;
+
+			case PACKET_EVENT_ACK:
+				events_acked( events_peer( v.from ), &v );
+				break;
+
+			case PACKET_SPECTATE:
+			case PACKET_SYNACK:
+				spectator_packet( &net, &spectators, v.type, v.from );
+				break;
 			}
 		}
+		timer_stop( PHASE_RECV );
 
-	  	if( input_status[0] )
+		timer_start( PHASE_CMDS );
+		if( seats.count )
 		{
-			player_move_cmd( &tc, CMD_PLAYER1_MOVE, -PADDLE_SPEED * ( delta / 1000.f ) );
-			add_to_cmd_buf( local_cmd_buf, tc );
+			paddle_move_cmd( 0, local_cmd_buf );
 		}
-		
-		if( input_status[1] )
+		else
 		{
-			player_move_cmd( &tc, CMD_PLAYER1_MOVE, PADDLE_SPEED * ( delta / 1000.f ) );
-			add_to_cmd_buf( local_cmd_buf, tc );
+			if( input_status[0] )
+			{
+				player_move_cmd( &tc, CMD_PLAYER1_MOVE, SCALAR_PER_MS( INT_TO_SCALAR( -PADDLE_SPEED ), delta ) );
+				add_to_cmd_buf( local_cmd_buf, tc );
+			}
+
+			if( input_status[1] )
+			{
+				player_move_cmd( &tc, CMD_PLAYER1_MOVE, SCALAR_PER_MS( INT_TO_SCALAR( PADDLE_SPEED ), delta ) );
+				add_to_cmd_buf( local_cmd_buf, tc );
+			}
 		}
 			
 		/*if( input_status[3] )
 		{
-			player_move_cmd( &tc, CMD_PLAYER2_MOVE, -PADDLE_SPEED * ( delta / 1000.f ) );
+			player_move_cmd( &tc, CMD_PLAYER2_MOVE, SCALAR_PER_MS( INT_TO_SCALAR( -PADDLE_SPEED ), delta ) );
 			add_to_cmd_buf( local_cmd_buf, tc );
 		}
 		
 		if( input_status[2] )
 		{
-			player_move_cmd( &tc, CMD_PLAYER2_MOVE, PADDLE_SPEED * ( delta / 1000.f ) );
+			player_move_cmd( &tc, CMD_PLAYER2_MOVE, SCALAR_PER_MS( INT_TO_SCALAR( PADDLE_SPEED ), delta ) );
 			add_to_cmd_buf( local_cmd_buf, tc );
 		}*/
-		
-		advance_gamestate( local_state.time, delta, 10, &local_state, local_cmd_buf );
+		timer_stop( PHASE_CMDS );
+
+		current_time = SDL_GetTicks() - start_time;
+
+		timer_start( PHASE_ADVANCE );
+		advance_gamestate( local_state.time, current_time - local_state.time, physics_step, &local_state, local_cmd_buf );
+		timer_stop( PHASE_ADVANCE );
 
 		clear_cmd_buf( local_cmd_buf );
 
+		timer_start( PHASE_RENDER );
 		SDL_RenderClear( renderer );
 
 		render_gamestate( &local_state );
+		timer_stop( PHASE_RENDER );
 
+		timer_start( PHASE_PRESENT );
 		SDL_RenderPresent( renderer );
+		timer_stop( PHASE_PRESENT );
+
+		/* Encode the update once for the player and every spectator */
+		timer_start( PHASE_SEND );
+		peer_live = seats.count || session_check( &net );
+		rates_frame( peer_live );
+		joiner_due = peer_live && ( !rates.hz || rates.joiner.due );
+		snap = snapshot_motion( &local_state );
+		if( seats.count )
+			seats_queue( snap );
+		else if( joiner_due )
+			net_send( &net, snap->data, snap->len, net.addr );
+		spectators_expire( &spectators );
+		spectators_send( &net, &spectators, snap );
+		snapshot_unref( snap );
+
+		if( multiball.owner )
+		{
+			snap = snapshot_balls( local_state.time );
+			if( seats.count )
+				seats_queue( snap );
+			else if( joiner_due )
+				net_send( &net, snap->data, snap->len, net.addr );
+			spectators_send( &net, &spectators, snap );
+			snapshot_unref( snap );
+		}
 
-		net_send_update( &net, net.addr, &local_state );
+		if( !seats.count && peer_live )
+			events_send( &net, &events.joiner, net.addr );
+		events_flush( &net );
+
+		if( seats.count )
+		{
+			seats_expire();
+			seats_flush( &net );
+		}
+		timer_stop( PHASE_SEND );
+
+		delta = SDL_GetTicks() - ticks;
+		ticks = SDL_GetTicks();
+		timers_frame();
+	}
+}
+
+/* Like the client, but it only ever watches */
+void spectator_loop()
+{
+	struct packet_view v;
+	const struct motion_packet *mp;
+	const struct balls_packet *bp;
+	const struct clock_packet *ck;
+	struct simple_packet keepalive;
+	SDL_Event event;
+	Uint32 ticks = SDL_GetTicks();
+	Uint32 last_keepalive = ticks;
+	start_time = ticks;
+
+	keepalive.type = PACKET_SPECTATE;
+	local_cmd_buf = init_cmd_buf( 0xFFF );
+
+	while( running )
+	{
+		timer_start( PHASE_FRAME );
+		timer_start( PHASE_POLL );
+		while( SDL_PollEvent( &event ) )
+		{
+			input( event );
+		}
+		timer_stop( PHASE_POLL );
+
+		timer_start( PHASE_RECV );
+		while( net_recv( &net, &v ) )
+		{
+			if( ( mp = packet_motion( &v ) ) != NULL )
+			{
+				motion_apply( mp, &local_state );
+			}
+			else if( v.type == PACKET_EVENTS )
+			{
+				events_recv( &net, &v, &local_state );
+			}
+			else if( ( bp = packet_balls( &v ) ) != NULL )
+			{
+				multiball_recv( bp );
+			}
+			else if( ( ck = packet_clock( &v ) ) != NULL )
+			{
+				timesync_recv( ck );
+			}
+		}
+		timer_stop( PHASE_RECV );
+
+		if( SDL_GetTicks() - last_keepalive > SPECTATE_INTERVAL )
+		{
+			net_simple_packet( &net, &keepalive, net.addr );
+			last_keepalive = SDL_GetTicks();
+		}
+
+		/* Relays don't answer pings, so watching through one never predicts */
+		timesync_ping( &net );
+		current_time = timesync.count ? timesync_now() : local_state.time;
+
+		timer_start( PHASE_ADVANCE );
+		if( local_state.time < current_time )
+		{
+			advance_gamestate( local_state.time, current_time - local_state.time, physics_step, &local_state, local_cmd_buf );
+		}
+		timer_stop( PHASE_ADVANCE );
+
+		timer_start( PHASE_RENDER );
+		SDL_RenderClear( renderer );
+
+		render_gamestate( &local_state );
+		timer_stop( PHASE_RENDER );
+
+		timer_start( PHASE_PRESENT );
+		SDL_RenderPresent( renderer );
+		timer_stop( PHASE_PRESENT );
 
 		delta = SDL_GetTicks() - ticks;
-		current_time = SDL_GetTicks() - start_time;
-		local_state.time = current_time;
 		ticks = SDL_GetTicks();
+		timers_frame();
+	}
+}
+
+/*
+ * Subscribes to the upstream host (or relay) exactly as a spectator would,
+ * and serves its own spectators from that one stream.  Relays take
+ * PACKET_SPECTATE from other relays too, so they can be chained.  The only
+ * state kept is the newest update, which lets late packets be dropped and
+ * new subscribers be sent something straight away.
+ */
+void relay_loop()
+{
+	struct packet_view v;
+	const struct motion_packet *mp;
+	uint32_t newest = 0, epoch = 0;
+	struct snapshot *latest = NULL, *snap;
+	struct simple_packet keepalive, synack;
+	unsigned updates_in = 0, updates_out = 0;
+	int got;
+	Uint32 last_keepalive = SDL_GetTicks();
+	Uint32 last_stats = last_keepalive;
+
+	keepalive.type = PACKET_SPECTATE;
+	synack.type = PACKET_SYNACK;
+
+	while( running )
+	{
+		timer_start( PHASE_FRAME );
+		timer_start( PHASE_RECV );
+		got = net_recv( &net, &v );
+		timer_stop( PHASE_RECV );
+
+		if( !got )
+		{
+			SDL_Delay( 1 );
+		}
+		else
+		{
+			if( v.from.host == net.addr.host && v.from.port == net.addr.port )
+			{
+				mp = packet_motion( &v );
+
+				/* No late packet is that far behind; a restarted host's
+				   clock starts again from 0 */
+				if( mp != NULL && mp->time + RELAY_RESTART_MS < newest )
+				{
+					printf( "relay: upstream restarted\n" );
+					fflush( stdout );
+					newest = 0;
+
+					/* Its events start over too, which their new epoch
+					   says once one comes, unless one already has */
+					if( events.epoch == epoch )
+						events_restart( epoch );
+				}
+
+				if( mp != NULL && mp->time >= newest )
+				{
+					newest = mp->time;
+					epoch = events.epoch;
+					if( latest )
+						snapshot_unref( latest );
+					latest = snapshot_new( v.data, v.len );
+
+					updates_in++;
+					timer_start( PHASE_SEND );
+					updates_out += spectators_send( &net, &spectators, latest );
+					timer_stop( PHASE_SEND );
+				}
+				else if( packet_balls( &v ) != NULL )
+				{
+					/* Chaos mode's extra balls are passed straight on */
+					snap = snapshot_new( v.data, v.len );
+					timer_start( PHASE_SEND );
+					spectators_send( &net, &spectators, snap );
+					timer_stop( PHASE_SEND );
+					snapshot_unref( snap );
+				}
+				else if( v.type == PACKET_EVENTS )
+				{
+					/* Kept in our own log, numbered as upstream's, for the
+					   flush below to pass on */
+					events_recv( &net, &v, NULL );
+				}
+				else if( v.type == PACKET_ACK )
+				{
+					/* Upstream answers every keepalive, but one that has
+					   restarted sends us nothing until we SYNACK again */
+					net_simple_packet( &net, &synack, net.addr );
+				}
+			}
+			else if( v.type == PACKET_EVENT_ACK )
+			{
+				events_acked( events_peer( v.from ), &v );
+			}
+			else if( v.type == PACKET_SPECTATE || v.type == PACKET_SYNACK )
+			{
+				spectator_packet( &net, &spectators, v.type, v.from );
+
+				if( v.type == PACKET_SYNACK && latest )
+				{
+					net_send( &net, latest->data, latest->len, v.from );
+				}
+			}
+		}
+
+		events_flush( &net );
+
+		if( SDL_GetTicks() - last_keepalive > SPECTATE_INTERVAL )
+		{
+			net_simple_packet( &net, &keepalive, net.addr );
+			spectators_expire( &spectators );
+			last_keepalive = SDL_GetTicks();
+		}
+
+		if( SDL_GetTicks() - last_stats > RELAY_STATS_INTERVAL )
+		{
+			printf( "relay: %d spectators, %u updates in, %u out\n", spectators.count, updates_in, updates_out );
+			fflush( stdout );
+			updates_in = updates_out = 0;
+			last_stats = SDL_GetTicks();
+		}
+
+		timers_frame();
 	}
+
+	if( latest )
+		snapshot_unref( latest );
 }
 
 void local_loop()
 {
+	struct cmd tc;
 	SDL_Event event;
 	Uint32 ticks = SDL_GetTicks();
 	start_time = ticks;
 
+	local_cmd_buf = init_cmd_buf( 0xFFF );
+
 	while( running )
 	{
+		timer_start( PHASE_FRAME );
+		timer_start( PHASE_POLL );
 		while( SDL_PollEvent( &event ) )
 		{
 			input( event );
 		}
+		timer_stop( PHASE_POLL );
 
-		
+		timer_start( PHASE_CMDS );
 	  	if( input_status[0] )
 		{
-			local_state.players[0].offset -= PADDLE_SPEED * ( delta / 1000.f );
+			player_move_cmd( &tc, CMD_PLAYER1_MOVE, SCALAR_PER_MS( INT_TO_SCALAR( -PADDLE_SPEED ), delta ) );
+			add_to_cmd_buf( local_cmd_buf, tc );
 		}
 		
 		if( input_status[1] )
 		{
-			local_state.players[0].offset += PADDLE_SPEED * ( delta / 1000.f );
+			player_move_cmd( &tc, CMD_PLAYER1_MOVE, SCALAR_PER_MS( INT_TO_SCALAR( PADDLE_SPEED ), delta ) );
+			add_to_cmd_buf( local_cmd_buf, tc );
 		}
-		
+			
 		if( input_status[3] )
 		{
-			local_state.players[1].offset -= PADDLE_SPEED * ( delta / 1000.f );
+			player_move_cmd( &tc, CMD_PLAYER2_MOVE, SCALAR_PER_MS( INT_TO_SCALAR( -PADDLE_SPEED ), delta ) );
+			add_to_cmd_buf( local_cmd_buf, tc );
 		}
-
+		
 		if( input_status[2] )
 		{
-			local_state.players[1].offset += PADDLE_SPEED * ( delta / 1000.f );
+			player_move_cmd( &tc, CMD_PLAYER2_MOVE, SCALAR_PER_MS( INT_TO_SCALAR( PADDLE_SPEED ), delta ) );
+			add_to_cmd_buf( local_cmd_buf, tc );
 		}
-		
+		timer_stop( PHASE_CMDS );
 
-		local_state.players[0].rect[0].y = local_state.players[0].offset;
-		local_state.players[1].rect[0].x = local_state.players[1].offset;
-		local_state.players[0].rect[1].y = local_state.players[0].offset;
-		local_state.players[1].rect[1].x = local_state.players[1].offset;
-
-		
-		local_state.ball.x += local_state.ball.xv * ( delta / 1000.f );
-		local_state.ball.y += local_state.ball.yv * ( delta / 1000.f );
-		
+		current_time = SDL_GetTicks() - start_time;
 
-		local_state.ball.rect.x = local_state.ball.x;
-		local_state.ball.rect.y = local_state.ball.y;
+		timer_start( PHASE_ADVANCE );
+		advance_gamestate( local_state.time, current_time - local_state.time, physics_step, &local_state, local_cmd_buf );
+		timer_stop( PHASE_ADVANCE );
 
-		
-		handle_ball( &local_state.ball, &local_state.players[0], &local_state.players[1] );
+		clear_cmd_buf( local_cmd_buf );
 
+		timer_start( PHASE_RENDER );
 		SDL_RenderClear( renderer );
 
 		render_gamestate( &local_state );
+		timer_stop( PHASE_RENDER );
 
+		timer_start( PHASE_PRESENT );
 		SDL_RenderPresent( renderer );
+		timer_stop( PHASE_PRESENT );
 
 		delta = SDL_GetTicks() - ticks;
-		current_time = SDL_GetTicks() - start_time;
-		local_state.time = current_time;
 		ticks = SDL_GetTicks();
+		timers_frame();
 	}
 }
 
-void white_rect( SDL_Rect *rect )
+void lockstep_init( int me, uint32_t delay )
 {
-	Uint8 r, g, b, a;
+	uint32_t t;
+
+	memset( &lockstep, 0, sizeof(lockstep) );
+	memset( lockstep.ticks, 0xFF, sizeof(lockstep.ticks) );
+	memset( lockstep.hash_ticks, 0xFF, sizeof(lockstep.hash_ticks) );
+	statehash_init( &lockstep.state );
+	lockstep.active = 1;
+	lockstep.me = me;
+	lockstep.delay = delay;
+
+	/* Nobody can have pressed anything before the first delayed tick */
+	for( t = 0; t < delay; t++ )
+	{
+		lockstep.ticks[0][t % LOCKSTEP_WINDOW] = t;
+		lockstep.ticks[1][t % LOCKSTEP_WINDOW] = t;
+	}
+	lockstep.next_input = lockstep.have = lockstep.peer_ack = delay;
 
-	SDL_GetRenderDrawColor( renderer, &r, &g, &b, &a );
-	SDL_SetRenderDrawColor( renderer, 255, 255, 255, 255 );
-	SDL_RenderFillRect( renderer, rect );
-	SDL_SetRenderDrawColor( renderer, r, g, b, a );
+	printf( "Lockstep with %u ticks (%ums) of input delay\n", delay, delay * LOCKSTEP_TICK );
 }
 
-void init_gamestate( struct gamestate *g )
+/*
+ * Runs for both the host and the joiner.  Nothing but inputs cross the
+ * wire between the players; the host still streams snapshots to any
+ * spectators.  Needs the same binary (ideally FIXED_PHYSICS) on both ends.
+ */
+void lockstep_loop()
 {
-	g->time = 0;
+	struct packet_view v;
+	const struct input_packet *in;
+	const struct update_packet *up;
+	struct simple_packet resync;
+	uint32_t now_tick;
+	struct snapshot *snap;
+	SDL_Event event;
+	Uint32 ticks = SDL_GetTicks();
+	start_time = ticks;
+
+	local_cmd_buf = init_cmd_buf( 0xFFF );
+	lockstep_hash( 0 );
 
-	g->players[0].rect[0].w = PADDLE_WIDTH;
-	g->players[0].rect[0].h = PADDLE_HEIGHT;
+	while( running )
+	{
+		timer_start( PHASE_FRAME );
+		timer_start( PHASE_POLL );
+		while( SDL_PollEvent( &event ) )
+		{
+			input( event );
+		}
+		timer_stop( PHASE_POLL );
 
-	g->players[0].rect[1].w = PADDLE_WIDTH;
-	g->players[0].rect[1].h = PADDLE_HEIGHT;
+		timer_start( PHASE_RECV );
+		while( net_recv( &net, &v ) )
+		{
+			if( v.from.host == net.addr.host && v.from.port == net.addr.port )
+			{
+				if( ( in = packet_input( &v ) ) != NULL )
+					lockstep_recv( in );
+				else if( v.type == PACKET_RESYNC && net.type == NET_HOST )
+					net_send_update( &net, net.addr, &local_state );
+				else if( ( up = packet_update( &v ) ) != NULL && net.type == NET_JOIN )
+					lockstep_resync( up );
+			}
+			else if( net.type == NET_HOST && ( v.type == PACKET_SPECTATE || v.type == PACKET_SYNACK ) )
+			{
+				spectator_packet( &net, &spectators, v.type, v.from );
+			}
+			else if( v.type == PACKET_EVENT_ACK )
+			{
+				events_acked( events_peer( v.from ), &v );
+			}
+		}
+		timer_stop( PHASE_RECV );
 
-	g->players[1].rect[0].w = PADDLE_HEIGHT;
-	g->players[1].rect[0].h = PADDLE_WIDTH;
+		current_time = SDL_GetTicks() - start_time;
+		now_tick = current_time / LOCKSTEP_TICK;
 
-	g->players[1].rect[1].w = PADDLE_HEIGHT;
-	g->players[1].rect[1].h = PADDLE_WIDTH;
+		timer_start( PHASE_CMDS );
+		lockstep_sample( now_tick );
+		timer_stop( PHASE_CMDS );
 
-	g->ball.rect.w = BALL_SIZE;
-	g->ball.rect.h = BALL_SIZE;
+		timer_start( PHASE_SEND );
+		if( lockstep.peer_ack < lockstep.next_input || SDL_GetTicks() - lockstep.last_send >= LOCKSTEP_TICK )
+		{
+			lockstep_send();
+		}
 
-	reset_ball( &g->ball );
+		/* The host's copy is the one that counts */
+		if( lockstep.desync && net.type == NET_JOIN && SDL_GetTicks() - lockstep.last_resync > HANDSHAKE_RETRY )
+		{
+			resync.type = PACKET_RESYNC;
+			net_simple_packet( &net, &resync, net.addr );
+			lockstep.last_resync = SDL_GetTicks();
+		}
+		timer_stop( PHASE_SEND );
 
-	g->players[0].rect[1].x = WIN_WIDTH - g->players[0].rect[1].w;
-	g->players[1].rect[1].y = WIN_HEIGHT - g->players[1].rect[1].h;
+		/* Run every tick we have both inputs for, but never ahead of the clock */
+		timer_start( PHASE_ADVANCE );
+		while( lockstep.sim_tick <= now_tick && lockstep.sim_tick < lockstep.have && lockstep.sim_tick < lockstep.next_input )
+		{
+			lockstep_cmds( lockstep.sim_tick, local_cmd_buf );
+			advance_gamestate( lockstep.sim_tick * LOCKSTEP_TICK, LOCKSTEP_TICK, physics_step, &local_state, local_cmd_buf );
+			clear_cmd_buf( local_cmd_buf );
+			lockstep.sim_tick++;
+			lockstep_hash( lockstep.sim_tick );
+		}
+		lockstep_check();
+		timer_stop( PHASE_ADVANCE );
 
-	g->ball.colliding = 0;
-}
+		timer_start( PHASE_RENDER );
+		SDL_RenderClear( renderer );
 
-void render_gamestate( struct gamestate *g )
-{
-	white_rect( &g->players[0].rect[0] );
-	white_rect( &g->players[1].rect[0] );
-	white_rect( &g->players[0].rect[1] );
-	white_rect( &g->players[1].rect[1] );
+		render_gamestate( &local_state );
+		timer_stop( PHASE_RENDER );
 
-	white_rect( &g->ball.rect );
-}
+		timer_start( PHASE_PRESENT );
+		SDL_RenderPresent( renderer );
+		timer_stop( PHASE_PRESENT );
 
-void reset_ball( struct ball *pball )
-{
-	pball->x = ( WIN_WIDTH / 2 ) - ( BALL_SIZE / 2 );
-	pball->y = ( WIN_HEIGHT / 2 ) - ( BALL_SIZE / 2 );
-	pball->xv = pball->yv = 0.0;
+		if( net.type == NET_HOST && spectators.count )
+		{
+			rates_frame( 0 );
+			snap = snapshot_motion( &local_state );
+			spectators_expire( &spectators );
+			spectators_send( &net, &spectators, snap );
+			snapshot_unref( snap );
+
+			if( multiball.owner )
+			{
+				snap = snapshot_balls( local_state.time );
+				spectators_send( &net, &spectators, snap );
+				snapshot_unref( snap );
+			}
+
+			events_flush( &net );
+		}
+
+		delta = SDL_GetTicks() - ticks;
+		ticks = SDL_GetTicks();
+		timers_frame();
+	}
 }
 
-void handle_ball( struct ball *pball, struct player *p1p, struct player *p2p )
+/* Samples the keys for every tick up to now + delay, as long as we don't
+   run so far ahead of the peer that its inputs would wrap the window */
+void lockstep_sample( uint32_t now_tick )
 {
-	SDL_Rect *p;
-	float dist;
-	if( pball->x + BALL_SIZE < 0 )
-	{
-		p2p->score ++;
-		reset_ball( pball );
-		return;
-	}
-	if( pball->x > WIN_WIDTH )
-	{
-		p2p->score ++;
-		reset_ball( pball );
-		return;
-	}
+	uint8_t bits = 0;
+	int minus, plus;
 
-	if( pball->y + BALL_SIZE < 0 )
+	if( lockstep.me == 0 )
 	{
-		p1p->score ++;
-		reset_ball( pball );
-		return;
+		minus = input_status[0];
+		plus = input_status[1];
 	}
-	if( pball->y > WIN_HEIGHT )
+	else
 	{
-		p1p->score ++;
-		reset_ball( pball );
-		return;
+		minus = input_status[3];
+		plus = input_status[2];
 	}
 
-    p = (SDL_Rect*)NULL;
+	if( minus )
+		bits |= INPUT_MINUS;
+	if( plus )
+		bits |= INPUT_PLUS;
 
-	if( SDL_HasIntersection( &pball->rect, &p1p->rect[0] ) )
-		p = &p1p->rect[0];
-	if( SDL_HasIntersection( &pball->rect, &p2p->rect[0] ) )
-		p = &p2p->rect[0];
-	if( SDL_HasIntersection( &pball->rect, &p1p->rect[1] ) )
-		p = &p1p->rect[1];
-	if( SDL_HasIntersection( &pball->rect, &p2p->rect[1] ) )
-		p = &p2p->rect[1];
-
-	if( p != NULL && pball->colliding == 0 )
+	while( lockstep.next_input <= now_tick + lockstep.delay && lockstep.next_input < lockstep.sim_tick + LOCKSTEP_WINDOW / 2 )
 	{
-		pball->xv = ( ( ( pball->x + BALL_SIZE / 2.0 ) - (p->x + p->w / 2.0 ) )  );
-		pball->yv = ( ( pball->y + BALL_SIZE / 2.0 ) - (p->y + p->h / 2.0 ) );
-		dist = dist_form( pball->xv, pball->yv );
-		pball->xv /= dist;
-		pball->yv /= dist;
-		pball->xv *= BALL_SPEED;
-		pball->yv *= BALL_SPEED;
-		pball->colliding = 1;
-	}
+		if( lockstep.serve )
+		{
+			bits |= INPUT_SERVE;
+			lockstep.serve = 0;
+		}
+		else
+		{
+			bits &= ~INPUT_SERVE;
+		}
 
-	if ( p == NULL )
-	{
-		pball->colliding = 0;
+		lockstep.ticks[lockstep.me][lockstep.next_input % LOCKSTEP_WINDOW] = lockstep.next_input;
+		lockstep.inputs[lockstep.me][lockstep.next_input % LOCKSTEP_WINDOW] = bits;
+		lockstep.next_input++;
 	}
 }
 
+void lockstep_send()
+{
+	struct input_packet ip;
+	uint32_t t;
+
+	ip.type = PACKET_INPUT;
+	ip.first = lockstep.peer_ack;
+	ip.ack = lockstep.have;
+	ip.hash_tick = lockstep.sim_tick;
+	ip.hash = lockstep.hashes[lockstep.sim_tick % LOCKSTEP_WINDOW];
+	ip.delay = (uint8_t)lockstep.delay;
+	ip.count = 0;
+
+	for( t = ip.first; t < lockstep.next_input && ip.count < LOCKSTEP_MAX_INPUTS; t++ )
+	{
+		ip.inputs[ip.count++] = lockstep.inputs[lockstep.me][t % LOCKSTEP_WINDOW];
+	}
+
+	net_send( &net, &ip, (int)( sizeof(ip) - LOCKSTEP_MAX_INPUTS + ip.count ), net.addr );
+	lockstep.last_send = SDL_GetTicks();
+}
+
+void lockstep_recv( const struct input_packet *in )
+{
+	int peer = 1 - lockstep.me;
+	uint32_t t;
+	int i;
+
+	if( in->delay != lockstep.delay )
+	{
+		printf( "Peer is using %u ticks of input delay and we are using %u, giving up\n", in->delay, lockstep.delay );
+		running = 0;
+		return;
+	}
+
+	if( in->ack > lockstep.peer_ack && in->ack <= lockstep.next_input )
+		lockstep.peer_ack = in->ack;
+
+	if( !lockstep.have_peer_hash || in->hash_tick > lockstep.peer_hash_tick )
+	{
+		lockstep.peer_hash = in->hash;
+		lockstep.peer_hash_tick = in->hash_tick;
+		lockstep.have_peer_hash = 1;
+	}
+
+	for( i = 0; i < in->count; i++ )
+	{
+		t = in->first + i;
+		if( t < lockstep.have || t >= lockstep.sim_tick + LOCKSTEP_WINDOW )
+			continue;
+
+		lockstep.ticks[peer][t % LOCKSTEP_WINDOW] = t;
+		lockstep.inputs[peer][t % LOCKSTEP_WINDOW] = in->inputs[i];
+	}
+
+	while( lockstep.ticks[peer][lockstep.have % LOCKSTEP_WINDOW] == lockstep.have )
+	{
+		lockstep.have++;
+	}
+}
+
+/* Remembers the hash of local_state as it stands at the start of tick */
+void lockstep_hash( uint32_t tick )
+{
+	lockstep.hashes[tick % LOCKSTEP_WINDOW] = statehash_update( &lockstep.state, &local_state );
+	lockstep.hash_ticks[tick % LOCKSTEP_WINDOW] = tick;
+}
+
+/* Checks the peer's latest hash against ours for the same tick, once we've
+   got that far.  One that has fallen out of our window is let go. */
+void lockstep_check()
+{
+	uint32_t t = lockstep.peer_hash_tick;
+	uint64_t ours;
+
+	if( !lockstep.have_peer_hash )
+		return;
+
+	if( lockstep.hash_ticks[t % LOCKSTEP_WINDOW] != t )
+	{
+		if( t < lockstep.sim_tick )
+			lockstep.have_peer_hash = 0;
+		return;
+	}
+
+	lockstep.have_peer_hash = 0;
+	ours = lockstep.hashes[t % LOCKSTEP_WINDOW];
+
+	if( ours == lockstep.peer_hash )
+	{
+		if( lockstep.desync )
+			printf( "Back in step at tick %u\n", t );
+		lockstep.desync = 0;
+	}
+	else if( !lockstep.desync )
+	{
+		printf( "Desync at tick %u: our state hashes to %08x%08x, the peer's to %08x%08x\n", t,
+			(uint32_t)( ours >> 32 ), (uint32_t)ours,
+			(uint32_t)( lockstep.peer_hash >> 32 ), (uint32_t)lockstep.peer_hash );
+		lockstep.desync = 1;
+	}
+}
+
+/*
+ * The host's state, sent when we asked because the hashes differed.  It's
+ * taken as a keyframe and played forward to where we'd got with the inputs
+ * we still hold; if the host is ahead we just jump to its tick, since
+ * everything before it is already in the state.
+ */
+void lockstep_resync( const struct update_packet *up )
+{
+	uint32_t t, tick = up->state.time / LOCKSTEP_TICK;
+	int p;
+
+	if( !lockstep.desync || up->state.time % LOCKSTEP_TICK != 0 || tick > lockstep.next_input )
+		return;
+
+	for( t = tick; t < lockstep.sim_tick; t++ )
+	{
+		for( p = 0; p < 2; p++ )
+		{
+			if( lockstep.ticks[p][t % LOCKSTEP_WINDOW] != t )
+				return; /* too far back, wait for a newer one */
+		}
+	}
+
+	local_state = up->state;
+	lockstep_hash( tick );
+	for( t = tick; t < lockstep.sim_tick; t++ )
+	{
+		lockstep_cmds( t, local_cmd_buf );
+		advance_gamestate( t * LOCKSTEP_TICK, LOCKSTEP_TICK, physics_step, &local_state, local_cmd_buf );
+		clear_cmd_buf( local_cmd_buf );
+		lockstep_hash( t + 1 );
+	}
+	if( tick > lockstep.sim_tick )
+		lockstep.sim_tick = tick;
+
+	printf( "Took the host's state from tick %u\n", tick );
+	lockstep.desync = 0;
+	lockstep.have_peer_hash = 0;
+}
+
+/* Turns both players' inputs for one tick back into ordinary commands */
+void lockstep_cmds( uint32_t tick, struct cmd_buf *buf )
+{
+	struct cmd c;
+	uint8_t bits;
+	int p;
+
+	for( p = 0; p < 2; p++ )
+	{
+		bits = lockstep.inputs[p][tick % LOCKSTEP_WINDOW];
+		c.time = tick * LOCKSTEP_TICK;
+
+		if( ( bits & INPUT_MINUS ) != ( bits & INPUT_PLUS ) >> 1 )
+		{
+			c.type = p == 0 ? CMD_PLAYER1_MOVE : CMD_PLAYER2_MOVE;
+			c.data.offset = SCALAR_PER_MS( INT_TO_SCALAR( ( bits & INPUT_MINUS ) ? -PADDLE_SPEED : PADDLE_SPEED ), LOCKSTEP_TICK );
+			add_to_cmd_buf( buf, c );
+		}
+
+		if( bits & INPUT_SERVE )
+		{
+			c.type = p == 0 ? CMD_PLAYER1_SERVE : CMD_PLAYER2_SERVE;
+			c.data.direction = -1;
+			add_to_cmd_buf( buf, c );
+		}
+	}
+}
+
+void white_rect( SDL_Rect *rect )
+{
+	Uint8 r, g, b, a;
+
+	SDL_GetRenderDrawColor( renderer, &r, &g, &b, &a );
+	SDL_SetRenderDrawColor( renderer, 255, 255, 255, 255 );
+	SDL_RenderFillRect( renderer, rect );
+	SDL_SetRenderDrawColor( renderer, r, g, b, a );
+}
+
+void init_gamestate( struct gamestate *g )
+{
+	memset( g, 0, sizeof(struct gamestate) );
+	reset_ball( &g->ball );
+}
+
+void render_gamestate( struct gamestate *g )
+{
+	SDL_Rect paddles[4], ball;
+	int i;
+
+	paddle_rects( g, paddles );
+	for( i = 0; i < 4; i++ )
+	{
+		white_rect( &paddles[i] );
+	}
+
+	if( multiball.owner == g )
+	{
+		multiball_render();
+	}
+	else
+	{
+		ball_rect( &g->ball, &ball );
+		white_rect( &ball );
+	}
+}
+
+/* Where the paddles are, left, top, right then bottom.  Player 1 has the
+   left and right ones and player 2 the top and bottom; only how far along
+   its side each one is comes from the state. */
+void paddle_rects( const struct gamestate *gs, SDL_Rect paddles[4] )
+{
+	const struct player *p1 = &gs->players[0], *p2 = &gs->players[1];
+
+	paddles[0].x = 0;
+	paddles[0].y = SCALAR_TO_INT( p1->offset );
+	paddles[2].x = WIN_WIDTH - PADDLE_WIDTH;
+	paddles[2].y = SCALAR_TO_INT( p1->offset + p1->split );
+	paddles[0].w = paddles[2].w = PADDLE_WIDTH;
+	paddles[0].h = paddles[2].h = PADDLE_HEIGHT;
+
+	paddles[1].x = SCALAR_TO_INT( p2->offset );
+	paddles[1].y = 0;
+	paddles[3].x = SCALAR_TO_INT( p2->offset + p2->split );
+	paddles[3].y = WIN_HEIGHT - PADDLE_WIDTH;
+	paddles[1].w = paddles[3].w = PADDLE_HEIGHT;
+	paddles[1].h = paddles[3].h = PADDLE_WIDTH;
+}
+
+void ball_rect( const struct ball *pball, SDL_Rect *r )
+{
+	r->x = SCALAR_TO_INT( pball->x );
+	r->y = SCALAR_TO_INT( pball->y );
+	r->w = BALL_SIZE;
+	r->h = BALL_SIZE;
+}
+
+/* Starts off as the hash of an all zero state */
+void statehash_init( struct statehash *sh )
+{
+	uint32_t i;
+
+	sh->hash = 0;
+	for( i = 0; i < STATE_WORDS; i++ )
+	{
+		sh->words[i] = 0;
+		sh->mixed[i] = statehash_word( i, 0 );
+		sh->hash ^= sh->mixed[i];
+	}
+}
+
+/* Brings the hash up to date with gs, whatever has changed since the last
+   call, and returns it */
+uint64_t statehash_update( struct statehash *sh, const struct gamestate *gs )
+{
+	uint32_t w[STATE_WORDS];
+	uint32_t i;
+
+	memcpy( w, gs, sizeof(w) );
+	for( i = 0; i < STATE_WORDS; i++ )
+	{
+		if( w[i] != sh->words[i] )
+		{
+			sh->hash ^= sh->mixed[i];
+			sh->words[i] = w[i];
+			sh->mixed[i] = statehash_word( i, w[i] );
+			sh->hash ^= sh->mixed[i];
+		}
+	}
+
+	return sh->hash;
+}
+
+/* The hash of one state on its own, for comparing two of them */
+uint64_t statehash_of( const struct gamestate *gs )
+{
+	struct statehash sh;
+
+	statehash_init( &sh );
+	return statehash_update( &sh, gs );
+}
+
+/* splitmix64's finaliser over the word and where it is, so the same value
+   in two places doesn't cancel out */
+uint64_t statehash_word( uint32_t i, uint32_t w )
+{
+	uint64_t z = ( (uint64_t)i << 32 | w ) + 0x9E3779B97F4A7C15ULL;
+
+	z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+	z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBULL;
+	return z ^ ( z >> 31 );
+}
+
+void reset_ball( struct ball *pball )
+{
+	pball->x = INT_TO_SCALAR( ( WIN_WIDTH / 2 ) - ( BALL_SIZE / 2 ) );
+	pball->y = INT_TO_SCALAR( ( WIN_HEIGHT / 2 ) - ( BALL_SIZE / 2 ) );
+	pball->xv = pball->yv = INT_TO_SCALAR( 0 );
+}
+
+/* A ball off the left or right is a point to player 2, off the top or
+   bottom one to player 1 */
+void handle_ball( struct ball *pball, uint16_t score[2] )
+{
+	if( pball->x + INT_TO_SCALAR( BALL_SIZE ) < 0 )
+	{
+		score[1] ++;
+		reset_ball( pball );
+		return;
+	}
+	if( pball->x > INT_TO_SCALAR( WIN_WIDTH ) )
+	{
+		score[1] ++;
+		reset_ball( pball );
+		return;
+	}
+
+	if( pball->y + INT_TO_SCALAR( BALL_SIZE ) < 0 )
+	{
+		score[0] ++;
+		reset_ball( pball );
+		return;
+	}
+	if( pball->y > INT_TO_SCALAR( WIN_HEIGHT ) )
+	{
+		score[0] ++;
+		reset_ball( pball );
+		return;
+	}
+}
+
+/*
+ * Moves the ball ms worth of its velocity, bouncing off the first paddle
+ * its box reaches on the way rather than only checking where it ends up, so
+ * a long step or a fast ball can't skip through a paddle.  The rest of the
+ * move carries on from the point of contact with the new velocity.  A
+ * paddle that moved into the ball bounces it once, as before; colliding
+ * stops it bouncing again while the two still overlap.  paddles comes from
+ * paddle_rects().
+ */
+void sweep_ball( struct ball *pball, SDL_Rect paddles[4], uint32_t ms )
+{
+	SDL_Rect *hit;
+	scalar dx, dy, left, best;
+	scalar enter_x, leave_x, enter_y, leave_y, enter, leave;
+	int i, bounces, bounced = 0, overlapping;
+
+	/* left is the fraction of the move still to go; where two paddles meet
+	   in a corner the ball could bounce between them, so give up after a few */
+	left = INT_TO_SCALAR( 1 );
+	for( bounces = 0; bounces < 4; bounces++ )
+	{
+		dx = SCALAR_MUL( SCALAR_PER_MS( pball->xv, ms ), left );
+		dy = SCALAR_MUL( SCALAR_PER_MS( pball->yv, ms ), left );
+
+		hit = NULL;
+		best = SCALAR_MAX;
+		overlapping = 0;
+		for( i = 0; i < 4; i++ )
+		{
+			sweep_axis( pball->x, dx, paddles[i].x, paddles[i].x + paddles[i].w, &enter_x, &leave_x );
+			sweep_axis( pball->y, dy, paddles[i].y, paddles[i].y + paddles[i].h, &enter_y, &leave_y );
+
+			/* Only overlapping on both axes at once is a hit, which is what
+			   keeps a ball skimming past a corner from catching it */
+			enter = enter_x > enter_y ? enter_x : enter_y;
+			leave = leave_x < leave_y ? leave_x : leave_y;
+			if( enter >= leave || leave <= 0 || enter > INT_TO_SCALAR( 1 ) )
+				continue;
+
+			if( enter < 0 )
+			{
+				overlapping = 1;
+				if( pball->colliding || bounced )
+					continue;
+				enter = 0;
+			}
+
+			if( enter <= best )
+			{
+				best = enter;
+				hit = &paddles[i];
+			}
+		}
+
+		if( hit == NULL )
+		{
+			pball->x += dx;
+			pball->y += dy;
+			break;
+		}
+
+		pball->x += SCALAR_MUL( dx, best );
+		pball->y += SCALAR_MUL( dy, best );
+		bounce_ball( pball, hit );
+		bounced = 1;
+
+		left = SCALAR_MUL( left, INT_TO_SCALAR( 1 ) - best );
+		if( left <= 0 )
+			break;
+	}
+
+	pball->colliding = bounced || overlapping;
+}
+
+/* When, as a fraction of move, the ball's box starts and stops overlapping
+   [lo, hi) along one axis */
+void sweep_axis( scalar pos, scalar move, int lo, int hi, scalar *enter, scalar *leave )
+{
+	scalar near_edge = INT_TO_SCALAR( lo - BALL_SIZE ) - pos;
+	scalar far_edge = INT_TO_SCALAR( hi ) - pos;
+
+	if( move == 0 )
+	{
+		if( near_edge < 0 && far_edge > 0 )
+		{
+			*enter = -SCALAR_MAX;
+			*leave = SCALAR_MAX;
+		}
+		else
+		{
+			*enter = SCALAR_MAX;
+			*leave = -SCALAR_MAX;
+		}
+	}
+	else if( move > 0 )
+	{
+		*enter = sweep_time( near_edge, move );
+		*leave = sweep_time( far_edge, move );
+	}
+	else
+	{
+		*enter = sweep_time( far_edge, move );
+		*leave = sweep_time( near_edge, move );
+	}
+}
+
+/* dist / move, kept in range when move is tiny */
+scalar sweep_time( scalar dist, scalar move )
+{
+#ifdef FIXED_PHYSICS
+	int64_t t = ( (int64_t)dist * SCALAR_ONE ) / move;
+
+	if( t > SCALAR_MAX )
+		return SCALAR_MAX;
+	if( t < -SCALAR_MAX )
+		return -SCALAR_MAX;
+	return (scalar)t;
+#else
+	return dist / move;
+#endif
+}
+
+void multiball_init( struct gamestate *owner, int count )
+{
+	int i, slot, across, slots;
+	int spacing = BALL_SIZE + 4, margin = PADDLE_WIDTH * 2;
+
+	multiball_reserve( count );
+	multiball.owner = owner;
+	multiball.count = count;
+
+	/* Ball 0 is the owner's.  The others start on a lattice clear of the
+	   paddles, each heading off a different way. */
+	across = ( WIN_WIDTH - 2 * margin ) / spacing;
+	slots = across * ( ( WIN_HEIGHT - 2 * margin ) / spacing );
+	for( i = 1; i < count; i++ )
+	{
+		slot = i % slots;
+		multiball_launch( &multiball.balls[i], multiball.launches++ );
+		multiball.balls[i].x = INT_TO_SCALAR( margin + ( slot % across ) * spacing );
+		multiball.balls[i].y = INT_TO_SCALAR( margin + ( slot / across ) * spacing );
+	}
+
+	printf( "Chaos mode with %d balls\n", count );
+}
+
+void multiball_reserve( int count )
+{
+	if( multiball.cell_start == NULL )
+	{
+		multiball.cols = WIN_WIDTH / MULTIBALL_CELL + 1;
+		multiball.rows = WIN_HEIGHT / MULTIBALL_CELL + 1;
+		multiball.cell_start = (int*)malloc( sizeof(int) * ( multiball.cols * multiball.rows + 1 ) );
+	}
+
+	if( count > multiball.cap )
+	{
+		multiball.cap = count;
+		multiball.balls = (struct ball*)realloc( multiball.balls, sizeof(struct ball) * multiball.cap );
+		multiball.rects = (SDL_Rect*)realloc( multiball.rects, sizeof(SDL_Rect) * multiball.cap );
+		multiball.cell_of = (int*)realloc( multiball.cell_of, sizeof(int) * multiball.cap );
+		multiball.order = (int*)realloc( multiball.order, sizeof(int) * multiball.cap );
+	}
+}
+
+/* Centres an extra ball and sends it off in the nth of twelve directions,
+   all BALL_SPEED long with whole number parts so fixed point stays exact */
+void multiball_launch( struct ball *pball, uint32_t n )
+{
+	static const int dirs[6][2] = { { 5, 0 }, { 4, 3 }, { 3, 4 }, { 0, 5 }, { -3, 4 }, { -4, 3 } };
+	int k = ( n * 5 ) % 12;
+	int sign = k < 6 ? 1 : -1;
+
+	reset_ball( pball );
+	pball->xv = INT_TO_SCALAR( sign * BALL_SPEED / 5 * dirs[k % 6][0] );
+	pball->yv = INT_TO_SCALAR( sign * BALL_SPEED / 5 * dirs[k % 6][1] );
+	pball->colliding = 0;
+}
+
+/* One physics step of every ball in chaos mode */
+void multiball_step( struct gamestate *gs, uint32_t ms )
+{
+	SDL_Rect paddles[4];
+	struct ball *b;
+	int i, scored;
+
+	multiball.balls[0] = gs->ball;
+	paddle_rects( gs, paddles );
+
+	for( i = 0; i < multiball.count; i++ )
+	{
+		b = &multiball.balls[i];
+		sweep_ball( b, paddles, ms );
+
+		/* Nobody serves the extra balls, so one that scores goes straight
+		   back into play */
+		scored = gs->score[0] + gs->score[1];
+		handle_ball( b, gs->score );
+		if( i > 0 && gs->score[0] + gs->score[1] != scored )
+			multiball_launch( b, multiball.launches++ );
+	}
+
+	multiball_collide();
+
+	gs->ball = multiball.balls[0];
+}
+
+/* Balls are bucketed by the cell their corner is in.  A cell is at least a
+   ball wide, so two balls can only touch if their cells are neighbours. */
+void multiball_collide()
+{
+	int cols = multiball.cols, rows = multiball.rows;
+	int i, j, k, c, x, y, cx, cy;
+
+	memset( multiball.cell_start, 0, sizeof(int) * ( cols * rows + 1 ) );
+	for( i = 0; i < multiball.count; i++ )
+	{
+		cx = SCALAR_TO_INT( multiball.balls[i].x ) / MULTIBALL_CELL;
+		cy = SCALAR_TO_INT( multiball.balls[i].y ) / MULTIBALL_CELL;
+		cx = cx < 0 ? 0 : cx >= cols ? cols - 1 : cx;
+		cy = cy < 0 ? 0 : cy >= rows ? rows - 1 : cy;
+
+		multiball.cell_of[i] = cy * cols + cx;
+		multiball.cell_start[cy * cols + cx]++;
+	}
+
+	/* Counting sort: turn the counts into where each cell ends, then fill
+	   backwards so each ends up holding where its cell starts */
+	for( c = 1; c <= cols * rows; c++ )
+	{
+		multiball.cell_start[c] += multiball.cell_start[c - 1];
+	}
+	for( i = multiball.count - 1; i >= 0; i-- )
+	{
+		multiball.order[--multiball.cell_start[multiball.cell_of[i]]] = i;
+	}
+
+	for( i = 0; i < multiball.count; i++ )
+	{
+		cx = multiball.cell_of[i] % cols;
+		cy = multiball.cell_of[i] / cols;
+
+		for( y = cy - 1; y <= cy + 1; y++ )
+		{
+			for( x = cx - 1; x <= cx + 1; x++ )
+			{
+				if( x < 0 || y < 0 || x >= cols || y >= rows )
+					continue;
+
+				c = y * cols + x;
+				for( k = multiball.cell_start[c]; k < multiball.cell_start[c + 1]; k++ )
+				{
+					j = multiball.order[k];
+					if( j > i )
+						multiball_bounce( &multiball.balls[i], &multiball.balls[j] );
+				}
+			}
+		}
+	}
+}
+
+/* The balls weigh the same, so a hit just swaps their velocities along
+   whichever axis the boxes overlap least on.  Balls already moving apart
+   are left be, which lets overlapping ones separate rather than stick. */
+void multiball_bounce( struct ball *a, struct ball *b )
+{
+	scalar dx = b->x - a->x, dy = b->y - a->y;
+	scalar adx = dx < 0 ? -dx : dx, ady = dy < 0 ? -dy : dy;
+	scalar rv, t;
+
+	if( adx >= INT_TO_SCALAR( BALL_SIZE ) || ady >= INT_TO_SCALAR( BALL_SIZE ) )
+		return;
+
+	if( adx >= ady )
+	{
+		rv = a->xv - b->xv;
+		if( ( rv > 0 && dx > 0 ) || ( rv < 0 && dx < 0 ) )
+		{
+			t = a->xv;
+			a->xv = b->xv;
+			b->xv = t;
+		}
+	}
+	else
+	{
+		rv = a->yv - b->yv;
+		if( ( rv > 0 && dy > 0 ) || ( rv < 0 && dy < 0 ) )
+		{
+			t = a->yv;
+			a->yv = b->yv;
+			b->yv = t;
+		}
+	}
+}
+
+/* Every ball in one draw call */
+void multiball_render()
+{
+	Uint8 r, g, b, a;
+	int i;
+
+	for( i = 1; i < multiball.count; i++ )
+	{
+		ball_rect( &multiball.balls[i], &multiball.rects[i] );
+	}
+	ball_rect( &multiball.owner->ball, &multiball.rects[0] ); /* newer if an update came in */
+
+	SDL_GetRenderDrawColor( renderer, &r, &g, &b, &a );
+	SDL_SetRenderDrawColor( renderer, 255, 255, 255, 255 );
+	SDL_RenderFillRects( renderer, multiball.rects, multiball.count );
+	SDL_SetRenderDrawColor( renderer, r, g, b, a );
+}
+
+/* Takes the host's extra balls, which is also how a client or spectator
+   finds out it's watching chaos mode */
+void multiball_recv( const struct balls_packet *bp )
+{
+	struct ball *b;
+	uint32_t i;
+
+	if( multiball.owner && bp->time < multiball.newest )
+		return;
+
+	multiball_reserve( bp->count + 1 );
+	multiball.owner = &local_state;
+	multiball.count = bp->count + 1;
+	multiball.newest = bp->time;
+
+	for( i = 0; i < bp->count; i++ )
+	{
+		b = &multiball.balls[i + 1];
+		b->x = bp->balls[i].x;
+		b->y = bp->balls[i].y;
+		b->xv = bp->balls[i].xv;
+		b->yv = bp->balls[i].yv;
+		b->colliding = bp->balls[i].colliding;
+	}
+}
+
+/* Send the ball away from the centre of the paddle it hit, at BALL_SPEED */
+#ifdef FIXED_PHYSICS
+void bounce_ball( struct ball *pball, SDL_Rect *p )
+{
+	scalar dx, dy;
+	uint32_t dist;
+
+	dx = ( pball->x + INT_TO_SCALAR( BALL_SIZE ) / 2 ) - ( INT_TO_SCALAR( p->x ) + INT_TO_SCALAR( p->w ) / 2 );
+	dy = ( pball->y + INT_TO_SCALAR( BALL_SIZE ) / 2 ) - ( INT_TO_SCALAR( p->y ) + INT_TO_SCALAR( p->h ) / 2 );
+
+	/* dx * dx is 32.32, so its square root comes back out as 16.16 */
+	dist = isqrt64( (uint64_t)( (int64_t)dx * dx + (int64_t)dy * dy ) );
+	if( dist == 0 )
+	{
+		pball->xv = INT_TO_SCALAR( -BALL_SPEED );
+		pball->yv = 0;
+		return;
+	}
+
+	pball->xv = (scalar)( ( (int64_t)dx * INT_TO_SCALAR( BALL_SPEED ) ) / (int64_t)dist );
+	pball->yv = (scalar)( ( (int64_t)dy * INT_TO_SCALAR( BALL_SPEED ) ) / (int64_t)dist );
+}
+
+/* Integer square root, rounded down */
+uint32_t isqrt64( uint64_t n )
+{
+	uint64_t r = 0;
+	uint64_t bit = (uint64_t)1 << 62;
+
+	while( bit > n )
+		bit >>= 2;
+
+	while( bit != 0 )
+	{
+		if( n >= r + bit )
+		{
+			n -= r + bit;
+			r = ( r >> 1 ) + bit;
+		}
+		else
+		{
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return (uint32_t)r;
+}
+#else
+void bounce_ball( struct ball *pball, SDL_Rect *p )
+{
+	float dist;
+
+	pball->xv = ( ( ( pball->x + BALL_SIZE / 2.0 ) - (p->x + p->w / 2.0 ) )  );
+	pball->yv = ( ( pball->y + BALL_SIZE / 2.0 ) - (p->y + p->h / 2.0 ) );
+	dist = dist_form( pball->xv, pball->yv );
+	pball->xv /= dist;
+	pball->yv /= dist;
+	pball->xv *= BALL_SPEED;
+	pball->yv *= BALL_SPEED;
+}
+#endif
+
+/* size is how many commands to make room for up front; the log grows past
+   it as needed */
 struct cmd_buf *init_cmd_buf( unsigned size )
 {
-	struct cmd_buf *r;
-	
-	printf( "init_cmd_buf called!\n" );
+	struct cmd_buf *r;
+	struct cmd_block *b;
+
+	r = (struct cmd_buf*)calloc( 1, sizeof(struct cmd_buf) );
+	r->slots = CMD_TICK_SLOTS;
+	r->ticks = (struct cmd_tick*)calloc( r->slots, sizeof(struct cmd_tick) );
+	r->generation = 1;
+
+	for( r->reserved = 0; r->reserved * CMD_BLOCK < size; r->reserved++ )
+	{
+		b = (struct cmd_block*)malloc( sizeof(struct cmd_block) );
+		b->next = r->free;
+		r->free = b;
+	}
+	r->blocks = r->reserved;
+
+	return r;
+}
+
+void free_cmd_buf( struct cmd_buf *p )
+{
+	struct cmd_block *b;
+
+	clear_cmd_buf( p );
+	while( p->free )
+	{
+		b = p->free;
+		p->free = b->next;
+		free( b );
+	}
+
+	free( p->ticks );
+	free( p );
+}
+
+void clear_cmd_buf( struct cmd_buf *p )
+{
+	if( p->head )
+	{
+		p->tail->next = p->free;
+		p->free = p->head;
+		p->head = p->tail = NULL;
+	}
+
+	p->len = 0;
+	p->tick_count = 0;
+
+	if( ++p->generation == 0 )
+	{
+		memset( p->ticks, 0, sizeof(struct cmd_tick) * p->slots );
+		p->generation = 1;
+	}
+}
+
+/* Commands are stamped with the next tick the simulation will run, so
+   advance_gamestate() always applies them and never skips or repeats one */
+void player_move_cmd( struct cmd *out, int type, scalar offset )
+{
+	out->data.offset = offset;
+	out->type = type;
+	out->time = local_state.time;
+}
+
+int add_to_cmd_buf( struct cmd_buf *buf, struct cmd cmd )
+{
+	struct cmd_block *b = buf->tail;
+	struct cmd_entry *e;
+	struct cmd_tick *t;
+
+	if( ( buf->tick_count + 1 ) * 2 > buf->slots && !cmd_buf_grow_ticks( buf ) )
+	{
+		buf->dropped++;
+		return 0;
+	}
+
+	if( b == NULL || b->len == CMD_BLOCK )
+	{
+		if( buf->free )
+		{
+			b = buf->free;
+			buf->free = b->next;
+		}
+		else
+		{
+			b = (struct cmd_block*)malloc( sizeof(struct cmd_block) );
+			if( b == NULL )
+			{
+				buf->dropped++;
+				return 0;
+			}
+			buf->blocks++;
+			buf->grown++;
+		}
+
+		b->next = NULL;
+		b->len = 0;
+		if( buf->tail )
+			buf->tail->next = b;
+		else
+			buf->head = b;
+		buf->tail = b;
+	}
+
+	e = &b->entries[ b->len++ ];
+	e->cmd = cmd;
+	e->next = NULL;
+
+	t = cmd_buf_slot( buf, cmd.time );
+	if( t->generation != buf->generation )
+	{
+		t->generation = buf->generation;
+		t->time = cmd.time;
+		t->head = e;
+		buf->tick_count++;
+	}
+	else
+	{
+		t->tail->next = e;
+	}
+	t->tail = e;
+
+	buf->len++;
+	if( buf->len > buf->peak )
+		buf->peak = buf->len;
+
+	return 1;
+}
+
+/* The table slot holding time's commands, or the empty one they'd go in */
+struct cmd_tick *cmd_buf_slot( struct cmd_buf *buf, uint32_t time )
+{
+	unsigned i = ( time * 2654435761u ) & ( buf->slots - 1 );
+
+	while( buf->ticks[i].generation == buf->generation && buf->ticks[i].time != time )
+	{
+		i = ( i + 1 ) & ( buf->slots - 1 );
+	}
+
+	return &buf->ticks[i];
+}
+
+/* First of the commands stamped with time, in the order they were added */
+struct cmd_entry *cmd_buf_tick( struct cmd_buf *buf, uint32_t time )
+{
+	struct cmd_tick *t;
+
+	if( buf->len == 0 )
+		return NULL;
+
+	t = cmd_buf_slot( buf, time );
+	return t->generation == buf->generation ? t->head : NULL;
+}
+
+/* Doubles the tick table, keeping it at most half full so probes stay short */
+int cmd_buf_grow_ticks( struct cmd_buf *buf )
+{
+	struct cmd_tick *old = buf->ticks, *t;
+	unsigned old_slots = buf->slots;
+	unsigned i;
+
+	buf->ticks = (struct cmd_tick*)calloc( old_slots * 2, sizeof(struct cmd_tick) );
+	if( buf->ticks == NULL )
+	{
+		buf->ticks = old;
+		return 0;
+	}
+	buf->slots = old_slots * 2;
+
+	for( i = 0; i < old_slots; i++ )
+	{
+		if( old[i].generation != buf->generation )
+			continue;
+
+		t = cmd_buf_slot( buf, old[i].time );
+		*t = old[i];
+	}
+
+	free( old );
+	return 1;
+}
+
+struct cmd_net_buf *cmd_to_net( struct cmd_buf *in )
+{
+	struct cmd_net_buf *r = (struct cmd_net_buf*)malloc( sizeof( uint32_t ) + ( in->len * sizeof( struct cmd ) ) );
+	struct cmd_block *b;
+	unsigned i, n = 0;
+
+	r->len = in->len;
+	for( b = in->head; b != NULL; b = b->next )
+	{
+		for( i = 0; i < b->len; i++ )
+			r->cmds[n++] = b->entries[i].cmd;
+	}
+	return r;
+}
+
+void advance_gamestate( uint32_t start, uint32_t duration, uint32_t timestep, struct gamestate *gs, struct cmd_buf *buf )
+{
+	uint32_t i;
+	struct cmd_entry *e;
+	struct player *p;
+	SDL_Rect paddles[4];
+	int scored, rewound;
+
+	for( i = 0; i < duration; i++ )
+	{
+		if( recorder.active && ( i + start ) % recorder.keyframe_ms == 0 )
+		{
+			replay_keyframe( gs, i + start, 0 );
+		}
+
+		for( e = cmd_buf_tick( buf, i + start ); e != NULL; e = e->next )
+		{
+			if( recorder.active )
+			{
+				replay_cmd( i + start, &e->cmd );
+			}
+
+			switch( e->cmd.type )
+			{
+			case CMD_PLAYER1_MOVE:
+				gs->players[0].offset += e->cmd.data.offset;
+				break;
+
+			case CMD_PLAYER2_MOVE:
+				gs->players[1].offset += e->cmd.data.offset;
+				break;
+
+			/* One paddle of a player on its own, leaving the other where it is */
+			case CMD_PADDLE1_MOVE:
+			case CMD_PADDLE2_MOVE:
+				p = &gs->players[e->cmd.type - CMD_PADDLE1_MOVE];
+				p->offset += e->cmd.data.offset;
+				p->split -= e->cmd.data.offset;
+				break;
+
+			case CMD_PADDLE3_MOVE:
+			case CMD_PADDLE4_MOVE:
+				gs->players[e->cmd.type - CMD_PADDLE3_MOVE].split += e->cmd.data.offset;
+				break;
+
+			case CMD_PLAYER1_SERVE:
+			case CMD_PLAYER2_SERVE:
+				reset_ball( &gs->ball );
+				gs->ball.xv = INT_TO_SCALAR( BALL_SPEED * e->cmd.data.direction );
+				if( events.owner == gs )
+					events_push( EVENT_SERVE, i + start, e->cmd.data.direction, gs );
+				break;
+			}
+		}
+
+		scored = gs->score[0] + gs->score[1];
+		if( ( i + start ) % timestep == 0 && multiball.owner == gs )
+		{
+			multiball_step( gs, timestep );
+		}
+		else if( ( i + start ) % timestep == 0 )
+		{
+			paddle_rects( gs, paddles );
+			sweep_ball( &gs->ball, paddles, timestep );
+
+			rewound = lagcomp.owner == gs && lagcomp_step( gs, i + start, timestep );
+
+			handle_ball( &gs->ball, gs->score );
+
+			/* Nothing in the command stream says a rewound hit happened.
+			   The keyframe waits for handle_ball, or a replay adopting it
+			   would never see a point scored on this tick. */
+			if( rewound )
+				replay_keyframe( gs, i + start + 1, 1 );
+		}
+
+		if( events.owner == gs && gs->score[0] + gs->score[1] != scored )
+			events_push( EVENT_SCORE, i + start, 0, gs );
+	}
+
+	gs->time = start + duration;
+}
+
+/*
+ * Replay files are a header followed by a stream of records.  The low four
+ * bits of the first byte are the record type:
+ *   REC_CMD      varint tick delta, type byte, 4 data bytes
+ *   REC_CMD_REF  varint tick delta; the high bits pick one of the last
+ *                REPLAY_DICT_SIZE distinct commands
+ *   REC_RUN      varint count; the high bits are a period of 1 or 2, and the
+ *                command that many back is repeated count times
+ *   REC_KEYFRAME u32 tick, raw struct gamestate; REC_OUT_OF_BAND is set
+ *                when the state changed outside the command stream, so it
+ *                has to be adopted rather than checked against
+ *   REC_END      u32 final tick
+ * Held keys produce long strings of identical moves, which is what the
+ * dictionary and runs are for.  Tick deltas and compression state restart
+ * at every keyframe, so decoding can begin at any of them.  On a clean stop
+ * a REC_INDEX of (tick, offset) pairs is appended, followed by its offset
+ * and REPLAY_INDEX_MAGIC, so a player can seek without scanning.
+ */
+int replay_start( const char *path, uint32_t keyframe_ms )
+{
+	memset( &recorder, 0, sizeof(recorder) );
+
+	recorder.file = fopen( path, "wb" );
+	if( recorder.file == NULL )
+	{
+		printf( "Could not open %s for recording: %s\n", path, strerror( errno ) );
+		return 0;
+	}
+
+	recorder.keyframe_ms = keyframe_ms ? keyframe_ms : 1;
+	recorder.lock = SDL_CreateMutex();
+	recorder.wake = SDL_CreateCond();
+
+	replay_put( REPLAY_MAGIC, 4 );
+	replay_put_u32( REPLAY_VERSION );
+	/* The low bit says which scalars the file holds and the top half is the
+	   physics step, where 0 (as in older files) means 10ms */
+#ifdef FIXED_PHYSICS
+	replay_put_u32( 1 | physics_step << 16 );
+#else
+	replay_put_u32( 0 | physics_step << 16 );
+#endif
+	replay_put_u32( recorder.keyframe_ms );
+	replay_put_u32( sizeof(struct gamestate) );
+
+	recorder.thread = SDL_CreateThread( replay_writer_thread, "replay", &recorder );
+	recorder.active = 1;
+
+	printf( "Recording to %s\n", path );
+	return 1;
+}
+
+void replay_stop( struct gamestate *gs )
+{
+	unsigned i;
+	uint32_t index_offset;
+
+	if( !recorder.active )
+		return;
+
+	replay_keyframe( gs, gs->time, 0 );
+	replay_put_u8( REC_END );
+	replay_put_u32( gs->time );
+
+	/* Let the writer finish, then append the index from this thread */
+	SDL_LockMutex( recorder.lock );
+	recorder.stopping = 1;
+	SDL_CondSignal( recorder.wake );
+	SDL_UnlockMutex( recorder.lock );
+	SDL_WaitThread( recorder.thread, NULL );
+	recorder.active = 0;
+
+	index_offset = recorder.offset;
+	replay_put_u8( REC_INDEX );
+	replay_put_u32( recorder.index_len / 2 );
+	for( i = 0; i < recorder.index_len; i++ )
+	{
+		replay_put_u32( recorder.index[i] );
+	}
+	replay_put_u32( index_offset );
+	replay_put( REPLAY_INDEX_MAGIC, 4 );
+
+	fwrite( recorder.pending, 1, recorder.pending_len, recorder.file );
+	fclose( recorder.file );
+
+	printf( "Replay closed, %u bytes\n", recorder.offset );
+
+	SDL_DestroyCond( recorder.wake );
+	SDL_DestroyMutex( recorder.lock );
+	free( recorder.pending );
+	free( recorder.out );
+	free( recorder.index );
+	memset( &recorder, 0, sizeof(recorder) );
+}
+
+void replay_cmd( uint32_t tick, struct cmd *c )
+{
+	struct replay_step step;
+	unsigned i;
+
+	step.delta = tick - recorder.last_tick;
+	step.type = c->type;
+	memcpy( &step.data, &c->data, sizeof(step.data) );
+	recorder.last_tick = tick;
+
+	/* Repeating the command one or two back, at the same spacing, just
+	   extends a run */
+	if( recorder.run_period == 0 )
+	{
+		for( i = 1; i <= recorder.hist_len; i++ )
+		{
+			if( replay_step_equal( &step, &recorder.hist[i - 1] ) )
+			{
+				recorder.run_period = i;
+				break;
+			}
+		}
+	}
+
+	if( recorder.run_period && replay_step_equal( &step, &recorder.hist[ recorder.run_period - 1 ] ) )
+	{
+		recorder.run_count++;
+		replay_push_step( recorder.hist, &recorder.hist_len, &step );
+		return;
+	}
+
+	replay_end_run();
+
+	for( i = 0; i < recorder.dict_len; i++ )
+	{
+		if( recorder.dict[i].type == step.type && recorder.dict[i].data == step.data )
+			break;
+	}
+
+	if( i < recorder.dict_len )
+	{
+		replay_put_u8( REC_CMD_REF | ( i << 4 ) );
+		replay_put_varint( step.delta );
+	}
+	else
+	{
+		replay_put_u8( REC_CMD );
+		replay_put_varint( step.delta );
+		replay_put_u8( (uint8_t)step.type );
+		replay_put_u32( step.data );
+
+		recorder.dict[ recorder.dict_next ] = step;
+		recorder.dict_next = ( recorder.dict_next + 1 ) % REPLAY_DICT_SIZE;
+		if( recorder.dict_len < REPLAY_DICT_SIZE )
+			recorder.dict_len++;
+	}
+
+	replay_push_step( recorder.hist, &recorder.hist_len, &step );
+	replay_flush( 0 );
+}
+
+void replay_end_run()
+{
+	if( recorder.run_count )
+	{
+		replay_put_u8( REC_RUN | ( recorder.run_period << 4 ) );
+		replay_put_varint( recorder.run_count );
+	}
+
+	recorder.run_period = 0;
+	recorder.run_count = 0;
+}
+
+int replay_step_equal( struct replay_step *a, struct replay_step *b )
+{
+	return a->delta == b->delta && a->type == b->type && a->data == b->data;
+}
+
+void replay_push_step( struct replay_step *hist, unsigned *len, struct replay_step *step )
+{
+	hist[1] = hist[0];
+	hist[0] = *step;
+	if( *len < 2 )
+		*len += 1;
+}
+
+void replay_keyframe( struct gamestate *gs, uint32_t tick, int out_of_band )
+{
+	struct gamestate kf;
+
+	if( !recorder.active )
+		return;
+
+	replay_end_run();
+
+	if( recorder.index_len == recorder.index_cap )
+	{
+		recorder.index_cap = recorder.index_cap ? recorder.index_cap * 2 : 256;
+		recorder.index = (uint32_t*)realloc( recorder.index, sizeof(uint32_t) * recorder.index_cap );
+	}
+	recorder.index[ recorder.index_len++ ] = tick;
+	recorder.index[ recorder.index_len++ ] = recorder.offset;
+
+	kf = *gs;
+	kf.time = tick;
+
+	recorder.dict_len = 0;
+	recorder.dict_next = 0;
+	recorder.hist_len = 0;
+
+	replay_put_u8( out_of_band ? REC_KEYFRAME | REC_OUT_OF_BAND : REC_KEYFRAME );
+	replay_put_u32( tick );
+	replay_put( &kf, sizeof(kf) );
+
+	recorder.last_tick = tick;
+	replay_flush( 1 );
+}
+
+void replay_put( const void *data, unsigned len )
+{
+	if( recorder.pending_len + len > recorder.pending_cap )
+	{
+		recorder.pending_cap = ( recorder.pending_len + len ) * 2;
+		recorder.pending = (uint8_t*)realloc( recorder.pending, recorder.pending_cap );
+	}
+
+	memcpy( recorder.pending + recorder.pending_len, data, len );
+	recorder.pending_len += len;
+	recorder.offset += len;
+}
+
+void replay_put_u8( uint8_t v )
+{
+	replay_put( &v, 1 );
+}
+
+/* Everything multi-byte goes out little endian */
+void replay_put_u32( uint32_t v )
+{
+	uint8_t b[4];
+
+	b[0] = v & 0xFF;
+	b[1] = ( v >> 8 ) & 0xFF;
+	b[2] = ( v >> 16 ) & 0xFF;
+	b[3] = ( v >> 24 ) & 0xFF;
+	replay_put( b, 4 );
+}
+
+void replay_put_varint( uint32_t v )
+{
+	uint8_t b;
+
+	do
+	{
+		b = v & 0x7F;
+		v >>= 7;
+		if( v )
+			b |= 0x80;
+		replay_put( &b, 1 );
+	} while( v );
+}
+
+/* Hand the pending buffer to the writer thread.  If it is still busy with
+   the last one we just keep accumulating rather than wait for it. */
+void replay_flush( int force )
+{
+	uint8_t *t;
+	unsigned cap;
+
+	if( !force && recorder.pending_len < REPLAY_FLUSH_SIZE )
+		return;
+
+	SDL_LockMutex( recorder.lock );
+	if( recorder.out_len == 0 )
+	{
+		t = recorder.out;
+		cap = recorder.out_cap;
+		recorder.out = recorder.pending;
+		recorder.out_cap = recorder.pending_cap;
+		recorder.out_len = recorder.pending_len;
+		recorder.pending = t;
+		recorder.pending_cap = cap;
+		recorder.pending_len = 0;
+		SDL_CondSignal( recorder.wake );
+	}
+	SDL_UnlockMutex( recorder.lock );
+}
+
+int replay_writer_thread( void *ptr )
+{
+	struct replay_writer *w = (struct replay_writer*)ptr;
+
+	if( tracer.active )
+		trace_register( "replay writer" );
+
+	SDL_LockMutex( w->lock );
+	for( ;; )
+	{
+		while( w->out_len == 0 && !w->stopping )
+		{
+			SDL_CondWait( w->wake, w->lock );
+		}
+
+		if( w->out_len == 0 && w->stopping )
+			break;
+
+		/* out is ours until out_len goes back to zero */
+		SDL_UnlockMutex( w->lock );
+		if( tracer.active )
+			trace_event( "replay write", 'B', w->out_len );
+		fwrite( w->out, 1, w->out_len, w->file );
+		fflush( w->file );
+		if( tracer.active )
+			trace_event( "replay write", 'E', 0 );
+		SDL_LockMutex( w->lock );
+		w->out_len = 0;
+	}
+	SDL_UnlockMutex( w->lock );
+
+	return 0;
+}
+
+int map_file( const char *path, struct mapped_file *m )
+{
+#ifdef _WIN32
+	m->file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( m->file == INVALID_HANDLE_VALUE )
+		return 0;
+
+	m->len = GetFileSize( m->file, NULL );
+	m->mapping = CreateFileMappingA( m->file, NULL, PAGE_READONLY, 0, 0, NULL );
+	if( m->mapping == NULL )
+	{
+		CloseHandle( m->file );
+		return 0;
+	}
+
+	m->data = (const uint8_t*)MapViewOfFile( m->mapping, FILE_MAP_READ, 0, 0, 0 );
+	if( m->data == NULL )
+	{
+		CloseHandle( m->mapping );
+		CloseHandle( m->file );
+		return 0;
+	}
+#else
+	int fd;
+	struct stat st;
+	void *p;
+
+	fd = open( path, O_RDONLY );
+	if( fd < 0 )
+		return 0;
+
+	if( fstat( fd, &st ) < 0 || st.st_size == 0 )
+	{
+		close( fd );
+		return 0;
+	}
+
+	p = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( p == MAP_FAILED )
+		return 0;
+
+	m->data = (const uint8_t*)p;
+	m->len = (uint32_t)st.st_size;
+#endif
+	return 1;
+}
+
+void unmap_file( struct mapped_file *m )
+{
+#ifdef _WIN32
+	UnmapViewOfFile( (void*)m->data );
+	CloseHandle( m->mapping );
+	CloseHandle( m->file );
+#else
+	munmap( (void*)m->data, m->len );
+#endif
+	m->data = NULL;
+	m->len = 0;
+}
+
+uint32_t get_u32( const uint8_t *p )
+{
+	return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (uint32_t)p[3] << 24 );
+}
+
+int replay_open( struct replay *r, const char *path )
+{
+	const uint8_t *d;
+	uint32_t index_offset, off;
+	unsigned i;
+
+	memset( r, 0, sizeof(*r) );
+
+	if( !map_file( path, &r->map ) )
+	{
+		printf( "Could not open replay %s\n", path );
+		return 0;
+	}
+
+	d = r->map.data;
+	if( r->map.len < REPLAY_HEADER_SIZE || memcmp( d, REPLAY_MAGIC, 4 ) != 0 )
+	{
+		printf( "%s is not a replay\n", path );
+		replay_close( r );
+		return 0;
+	}
+
+#ifdef FIXED_PHYSICS
+	if( get_u32( d + 4 ) != REPLAY_VERSION || ( get_u32( d + 8 ) & 0xFFFF ) != 1 || get_u32( d + 16 ) != sizeof(struct gamestate) )
+#else
+	if( get_u32( d + 4 ) != REPLAY_VERSION || ( get_u32( d + 8 ) & 0xFFFF ) != 0 || get_u32( d + 16 ) != sizeof(struct gamestate) )
+#endif
+	{
+		printf( "%s was recorded by an incompatible build\n", path );
+		replay_close( r );
+		return 0;
+	}
+
+	r->keyframe_ms = get_u32( d + 12 );
+	r->step = get_u32( d + 8 ) >> 16;
+	if( r->step == 0 )
+		r->step = 10;
+
+	if( r->keyframe_ms == 0 )
+	{
+		printf( "%s is not a replay\n", path );
+		replay_close( r );
+		return 0;
+	}
+
+	/* A cleanly closed replay ends with its index, END just before it.
+	   The count has to fill the space exactly, and every entry has to be a
+	   keyframe, in order, between the header and END. */
+	index_offset = r->map.len >= REPLAY_HEADER_SIZE + 8 ? get_u32( d + r->map.len - 8 ) : 0;
+	if( memcmp( d + r->map.len - 4, REPLAY_INDEX_MAGIC, 4 ) == 0
+		&& index_offset >= REPLAY_HEADER_SIZE + 5 && index_offset <= r->map.len - 8 - 5
+		&& d[index_offset] == REC_INDEX && d[index_offset - 5] == REC_END )
+	{
+		r->keyframes = get_u32( d + index_offset + 1 );
+		if( r->keyframes > 0 && r->keyframes == ( r->map.len - 8 - index_offset - 5 ) / 8
+			&& ( r->map.len - 8 - index_offset - 5 ) % 8 == 0 )
+		{
+			r->index = (uint32_t*)malloc( sizeof(uint32_t) * 2 * ( r->keyframes + 1 ) );
+			for( i = 0; i < r->keyframes; i++ )
+			{
+				r->index[i * 2] = get_u32( d + index_offset + 5 + i * 8 );
+				r->index[i * 2 + 1] = off = get_u32( d + index_offset + 9 + i * 8 );
+
+				/* A keyframe's record, then at least END, before the index */
+				if( off < REPLAY_HEADER_SIZE || off >= index_offset || index_offset - off < 10 + sizeof(struct gamestate)
+					|| ( d[off] & 0x0F ) != REC_KEYFRAME || get_u32( d + off + 1 ) != r->index[i * 2]
+					|| ( i > 0 && r->index[i * 2] < r->index[i * 2 - 2] ) )
+				{
+					free( r->index );
+					r->index = NULL;
+					break;
+				}
+			}
+			r->end_tick = get_u32( d + index_offset - 4 );
+		}
+	}
+
+	/* Otherwise the recorder died mid-match and we have to find them */
+	if( r->index == NULL && !replay_scan_index( r ) )
+	{
+		printf( "%s has no keyframes\n", path );
+		replay_close( r );
+		return 0;
+	}
+
+	return 1;
+}
+
+void replay_close( struct replay *r )
+{
+	if( r->map.data )
+		unmap_file( &r->map );
+	free( r->index );
+	r->index = NULL;
+}
+
+/* Walk every record, noting keyframes and the last tick, until the data
+   runs out or stops making sense */
+int replay_scan_index( struct replay *r )
+{
+	struct replay_cursor c;
+	struct cmd cmd;
+	uint32_t tick = 0;
+	uint32_t off;
+	unsigned cap = 0;
+	int rec;
+
+	r->keyframes = 0;
+	replay_cursor_reset( &c, REPLAY_HEADER_SIZE, 0 );
+
+	for( ;; )
+	{
+		off = c.offset;
+		rec = replay_read( r, &c, &cmd, &tick );
+
+		if( rec == REC_KEYFRAME )
+		{
+			if( r->keyframes == cap )
+			{
+				cap = cap ? cap * 2 : 256;
+				r->index = (uint32_t*)realloc( r->index, sizeof(uint32_t) * 2 * cap );
+			}
+			r->index[ r->keyframes * 2 ] = tick;
+			r->index[ r->keyframes * 2 + 1 ] = off;
+			r->keyframes++;
+		}
+		else if( rec != REC_CMD )
+		{
+			break;
+		}
+	}
+
+	r->end_tick = tick;
+	return r->keyframes > 0;
+}
+
+void replay_cursor_reset( struct replay_cursor *c, uint32_t offset, uint32_t tick )
+{
+	c->offset = offset;
+	c->last_tick = tick;
+	c->dict_len = 0;
+	c->dict_next = 0;
+	c->hist_len = 0;
+	c->run_period = 0;
+	c->run_left = 0;
+}
+
+/*
+ * Decode the next command or keyframe at the cursor.  Commands come back in
+ * cmd, stamped with their tick; for keyframes only the tick is filled in and
+ * the state itself is left at c->offset - sizeof(struct gamestate).  Returns
+ * the record type, REC_END at the end of the replay, or 0 on bad data.
+ */
+int replay_read( struct replay *r, struct replay_cursor *c, struct cmd *cmd, uint32_t *tick )
+{
+	const uint8_t *d = r->map.data;
+	struct replay_step step;
+	uint32_t off = c->offset;
+	uint32_t v;
+	unsigned arg;
+
+	while( c->run_left == 0 )
+	{
+		if( off >= r->map.len )
+			return 0;
+
+		arg = d[off] >> 4;
+
+		switch( d[off++] & 0x0F )
+		{
+		case REC_CMD:
+			if( !replay_get_varint( r, &off, &step.delta ) || off + 5 > r->map.len )
+				return 0;
+			step.type = d[off];
+			step.data = get_u32( d + off + 1 );
+			off += 5;
+
+			c->dict[ c->dict_next ] = step;
+			c->dict_next = ( c->dict_next + 1 ) % REPLAY_DICT_SIZE;
+			if( c->dict_len < REPLAY_DICT_SIZE )
+				c->dict_len++;
+			goto got_step;
+
+		case REC_CMD_REF:
+			if( arg >= c->dict_len || !replay_get_varint( r, &off, &v ) )
+				return 0;
+			step = c->dict[arg];
+			step.delta = v;
+			goto got_step;
+
+		case REC_RUN:
+			if( arg < 1 || arg > c->hist_len || !replay_get_varint( r, &off, &v ) )
+				return 0;
+			c->run_period = arg;
+			c->run_left = v;
+			break;
+
+		case REC_KEYFRAME:
+			if( off + 4 + sizeof(struct gamestate) > r->map.len )
+				return 0;
+			*tick = get_u32( d + off );
+			replay_cursor_reset( c, off + 4 + sizeof(struct gamestate), *tick );
+			c->out_of_band = ( d[off - 1] & REC_OUT_OF_BAND ) != 0;
+			return REC_KEYFRAME;
+
+		case REC_END:
+			if( off + 4 > r->map.len )
+				return 0;
+			*tick = get_u32( d + off );
+			return REC_END;
+
+		default:
+			return 0;
+		}
+	}
+
+	c->run_left--;
+	step = c->hist[ c->run_period - 1 ];
+
+got_step:
+	c->offset = off;
+	replay_push_step( c->hist, &c->hist_len, &step );
+	c->last_tick += step.delta;
+
+	cmd->type = step.type;
+	cmd->time = c->last_tick;
+	memcpy( &cmd->data, &step.data, sizeof(step.data) );
+	*tick = c->last_tick;
+	return REC_CMD;
+}
+
+int replay_get_varint( struct replay *r, uint32_t *off, uint32_t *v )
+{
+	int shift;
+
+	*v = 0;
+	for( shift = 0; shift < 35 && *off < r->map.len; shift += 7 )
+	{
+		*v |= ( r->map.data[*off] & 0x7F ) << shift;
+		if( !( r->map.data[ (*off)++ ] & 0x80 ) )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Binary search for the last keyframe at or before tick */
+unsigned replay_find_keyframe( struct replay *r, uint32_t tick )
+{
+	unsigned lo = 0, hi = r->keyframes;
+	unsigned mid;
+
+	while( hi - lo > 1 )
+	{
+		mid = ( lo + hi ) / 2;
+		if( r->index[ mid * 2 ] <= tick )
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Restore the nearest keyframe and run the engine forward to tick */
+void replay_seek( struct replay *r, struct replay_cursor *c, uint32_t tick, struct gamestate *gs )
+{
+	unsigned k;
+	uint32_t off;
+
+	if( tick > r->end_tick )
+		tick = r->end_tick;
+
+	k = replay_find_keyframe( r, tick );
+	off = r->index[ k * 2 + 1 ];
+
+	memcpy( gs, r->map.data + off + 5, sizeof(struct gamestate) );
+	replay_cursor_reset( c, off + 5 + sizeof(struct gamestate), gs->time );
+	clear_cmd_buf( c->buf );
+
+	replay_advance( r, c, tick, gs );
+}
+
+/*
+ * Feed recorded commands through advance_gamestate() until gs reaches
+ * tick.  The engine is run up to each new command tick as we go, which keeps
+ * the command buffer tiny however far we are skipping.  Keyframes on the way
+ * are adopted as-is, since they also carry anything that happened outside
+ * the command stream.  Returns 0 once the end of the replay is reached.
+ */
+int replay_advance( struct replay *r, struct replay_cursor *c, uint32_t tick, struct gamestate *gs )
+{
+	struct replay_cursor saved;
+	struct cmd cmd;
+	uint32_t t;
+	int rec;
+
+	if( tick > r->end_tick )
+		tick = r->end_tick;
+
+	for( ;; )
+	{
+		saved = *c;
+		rec = replay_read( r, c, &cmd, &t );
+
+		if( rec == REC_CMD && t < tick )
+		{
+			if( t > gs->time )
+			{
+				advance_gamestate( gs->time, t - gs->time, r->step, gs, c->buf );
+				clear_cmd_buf( c->buf );
+			}
+			add_to_cmd_buf( c->buf, cmd );
+		}
+		else if( rec == REC_KEYFRAME && t <= tick )
+		{
+			if( t > gs->time )
+			{
+				advance_gamestate( gs->time, t - gs->time, r->step, gs, c->buf );
+			}
+			clear_cmd_buf( c->buf );
+			memcpy( gs, r->map.data + c->offset - sizeof(struct gamestate), sizeof(struct gamestate) );
+		}
+		else
+		{
+			/* Not there yet; leave it for next time */
+			*c = saved;
+			break;
+		}
+	}
+
+	if( tick > gs->time )
+	{
+		advance_gamestate( gs->time, tick - gs->time, r->step, gs, c->buf );
+	}
+	clear_cmd_buf( c->buf );
+
+	return gs->time < r->end_tick;
+}
+
+int replay_main( int argc, char **argv )
+{
+	struct replay r;
+	const char *opt;
+	uint32_t tick;
+	int speed;
+	int ret = 0;
+
+	if( !replay_open( &r, argv[2] ) )
+		return 1;
+
+	printf( "Replay: %u keyframes, %u:%02u long\n", r.keyframes, r.end_tick / 60000, ( r.end_tick / 1000 ) % 60 );
+
+	opt = get_option( argc, argv, "--seek" );
+	tick = opt ? atoi( opt ) * 1000 : 0;
+
+	opt = get_option( argc, argv, "--speed" );
+	speed = opt ? atoi( opt ) : 1;
+	if( speed < 1 )
+		speed = 1;
+	if( speed > REPLAY_MAX_SPEED )
+		speed = REPLAY_MAX_SPEED;
+
+	opt = get_option( argc, argv, "--export" );
+	if( opt )
+	{
+		ret = !replay_export( &r, tick, opt );
+	}
+	else if( init() )
+	{
+		replay_loop( &r, tick, speed );
+	}
+	else
+	{
+		printf( "an error occurred\n" );
+		ret = 1;
+	}
+
+	replay_close( &r );
+	quit();
+	return ret;
+}
+
+/* Space pauses, left/right skip, up/down change speed */
+void replay_loop( struct replay *r, uint32_t tick, int speed )
+{
+	struct replay_cursor c;
+	SDL_Event event;
+	int paused = 0;
+	Uint32 ticks = SDL_GetTicks();
+
+	c.buf = init_cmd_buf( 0xFFF );
+	replay_seek( r, &c, tick, &local_state );
+
+	while( running )
+	{
+		while( SDL_PollEvent( &event ) )
+		{
+			if( event.type == SDL_QUIT )
+			{
+				running = 0;
+			}
+			else if( event.type == SDL_KEYUP )
+			{
+				switch( event.key.keysym.sym )
+				{
+				case SDLK_SPACE:
+					paused = !paused;
+					break;
+				case SDLK_RIGHT:
+					replay_seek( r, &c, local_state.time + REPLAY_SKIP_MS, &local_state );
+					break;
+				case SDLK_LEFT:
+					replay_seek( r, &c, local_state.time > REPLAY_SKIP_MS ? local_state.time - REPLAY_SKIP_MS : 0, &local_state );
+					break;
+				case SDLK_UP:
+					speed = speed * 2 > REPLAY_MAX_SPEED ? REPLAY_MAX_SPEED : speed * 2;
+					break;
+				case SDLK_DOWN:
+					speed = speed / 2 < 1 ? 1 : speed / 2;
+					break;
+				}
+			}
+		}
+
+		if( !paused )
+		{
+			replay_advance( r, &c, local_state.time + delta * speed, &local_state );
+		}
+
+		SDL_RenderClear( renderer );
+
+		render_gamestate( &local_state );
+
+		SDL_RenderPresent( renderer );
+
+		delta = SDL_GetTicks() - ticks;
+		ticks = SDL_GetTicks();
+	}
+
+	free_cmd_buf( c.buf );
+}
+
+/* Headless: dump the match as CSV, one line every REPLAY_EXPORT_MS */
+int replay_export( struct replay *r, uint32_t tick, const char *path )
+{
+	struct replay_cursor c;
+	struct gamestate gs;
+	FILE *f;
+	int more = 1;
+
+	f = fopen( path, "w" );
+	if( f == NULL )
+	{
+		printf( "Could not open %s: %s\n", path, strerror( errno ) );
+		return 0;
+	}
+
+	c.buf = init_cmd_buf( 0xFFF );
+	replay_seek( r, &c, tick, &gs );
+
+	fprintf( f, "time,ball_x,ball_y,ball_xv,ball_yv,p1_offset,p2_offset,p1_score,p2_score\n" );
+	for( ;; )
+	{
+		fprintf( f, "%u,%d,%d,%d,%d,%d,%d,%d,%d\n", gs.time,
+			SCALAR_TO_INT( gs.ball.x ), SCALAR_TO_INT( gs.ball.y ),
+			SCALAR_TO_INT( gs.ball.xv ), SCALAR_TO_INT( gs.ball.yv ),
+			SCALAR_TO_INT( gs.players[0].offset ), SCALAR_TO_INT( gs.players[1].offset ),
+			gs.score[0], gs.score[1] );
+
+		if( !more )
+			break;
+
+		more = replay_advance( r, &c, gs.time + REPLAY_EXPORT_MS, &gs );
+	}
+
+	free_cmd_buf( c.buf );
+	fclose( f );
+
+	printf( "Exported to %s\n", path );
+	return 1;
+}
+
+/*
+ * Finds the first tick where two replays of the same match part ways, or
+ * with only one, the first keyframe its own commands don't lead to.
+ *
+ * Two replays are compared at each of the first one's keyframes, which
+ * are free to read, against the second sought to the same tick, which
+ * costs at most a keyframe interval of simulation.  Once they differ they
+ * stay different, so a binary search over the keyframes finds the last one
+ * they agree on, and stepping both a tick at a time from there finds the
+ * exact tick.  A half hour match takes a dozen seeks, not a replay.
+ *
+ * On its own, a replay's regular keyframes are each checked against
+ * re-simulating from the keyframe before.  Those checks don't depend on
+ * each other, so they are all made, and the first that fails is shown.
+ */
+int bisect_main( int argc, char **argv )
+{
+	struct replay ra, rb;
+	struct bisect_side a, b;
+	struct gamestate ga, gb;
+	uint32_t *ticks, end, t, from = 0;
+	unsigned n = 0, k, failed = 0, probes = 0;
+	int lo, hi, mid;
+	Uint64 started = SDL_GetPerformanceCounter();
+
+	if( !replay_open( &ra, argv[2] ) )
+		return 1;
+
+	memset( &a, 0, sizeof(a) );
+	a.r = &ra;
+	a.name = argv[2];
+	a.c.buf = init_cmd_buf( 0xFFF );
+	b = a;
+	b.c.buf = init_cmd_buf( 0xFFF );
+
+	if( argc > 3 )
+	{
+		if( !replay_open( &rb, argv[3] ) )
+			return 1;
+		if( rb.step != ra.step )
+		{
+			printf( "%s and %s were recorded with different physics steps\n", argv[2], argv[3] );
+			return 1;
+		}
+		b.r = &rb;
+		b.name = argv[3];
+	}
+	else
+	{
+		b.name = "re-simulated";
+		b.resim = 1;
+	}
+
+	end = ra.end_tick < b.r->end_tick ? ra.end_tick : b.r->end_tick;
+
+	/* The ticks to probe.  Re-simulating needs a keyframe before, and
+	   only the regular ones can be compared with it: the others record
+	   things that happened outside the command stream. */
+	ticks = (uint32_t*)malloc( sizeof(uint32_t) * ( ra.keyframes + 1 ) );
+	for( k = 0; k < ra.keyframes; k++ )
+	{
+		t = ra.index[k * 2];
+		if( t > end || ( n > 0 && t == ticks[n - 1] ) )
+			continue;
+		if( b.resim && ( t == ra.index[0] || ( ra.map.data[ ra.index[k * 2 + 1] ] & REC_OUT_OF_BAND ) ) )
+			continue;
+		ticks[n++] = t;
+	}
+	if( !b.resim && ( n == 0 || ticks[n - 1] < end ) )
+		ticks[n++] = end;
+
+	hi = -1;
+	if( b.resim )
+	{
+		for( k = 0; k < n; k++ )
+		{
+			bisect_state( &a, ticks[k], &ga );
+			bisect_state( &b, ticks[k], &gb );
+			probes++;
+			if( statehash_of( &ga ) == statehash_of( &gb ) )
+				continue;
+			if( failed++ == 0 )
+				hi = k;
+		}
+	}
+	else if( n > 0 )
+	{
+		/* lo agrees and hi doesn't, with -1 before the first */
+		bisect_state( &a, ticks[n - 1], &ga );
+		bisect_state( &b, ticks[n - 1], &gb );
+		probes++;
+		if( statehash_of( &ga ) != statehash_of( &gb ) )
+		{
+			lo = -1;
+			hi = n - 1;
+			while( hi - lo > 1 )
+			{
+				mid = ( lo + hi ) / 2;
+				bisect_state( &a, ticks[mid], &ga );
+				bisect_state( &b, ticks[mid], &gb );
+				probes++;
+				if( statehash_of( &ga ) == statehash_of( &gb ) )
+					lo = mid;
+				else
+					hi = mid;
+			}
+			from = lo >= 0 ? ticks[lo] : 0;
+		}
+	}
+
+	if( hi < 0 )
+	{
+		printf( "No differences in %u keyframes up to tick %u\n", n, end );
+	}
+	else
+	{
+		t = ticks[hi];
+		if( b.resim )
+		{
+			printf( "%u of %u keyframes don't match re-simulating from the one before\n", failed, n );
+			printf( "First at tick %u, from the keyframe at tick %u\n", t, ra.index[ replay_find_keyframe( &ra, t - 1 ) * 2 ] );
+		}
+		else if( hi > 0 )
+		{
+			t = bisect_ticks( &a, &b, from, t, &ga, &gb );
+			printf( "Keyframes agree up to tick %u; the first difference is at tick %u\n", from, t );
+		}
+		else
+		{
+			printf( "The replays already differ at tick %u\n", t );
+		}
+
+		bisect_state( &a, t, &ga );
+		bisect_state( &b, t, &gb );
+		bisect_diff( &ga, &gb, a.name, b.name );
+	}
+
+	printf( "%u probes in %.2fms\n", probes,
+		(double)( SDL_GetPerformanceCounter() - started ) * 1000.0 / SDL_GetPerformanceFrequency() );
+
+	free( ticks );
+	free_cmd_buf( a.c.buf );
+	free_cmd_buf( b.c.buf );
+	if( b.r != &ra )
+		replay_close( &rb );
+	replay_close( &ra );
+	return hi >= 0;
+}
+
+/* The state a side has at tick, from the nearest keyframe.  Re-simulating
+   stops a tick short and runs the last one by hand, so a keyframe at tick
+   itself isn't just taken as the answer, unless it is out of band and so
+   something the commands can't reproduce. */
+void bisect_state( struct bisect_side *s, uint32_t tick, struct gamestate *gs )
+{
+	struct replay_cursor saved;
+	struct cmd cmd;
+	uint32_t t;
+	int rec;
+
+	if( !s->resim || tick == 0 )
+	{
+		replay_seek( s->r, &s->c, tick, gs );
+		return;
+	}
+
+	replay_seek( s->r, &s->c, tick - 1, gs );
+	for( ;; )
+	{
+		saved = s->c;
+		rec = replay_read( s->r, &s->c, &cmd, &t );
+		if( rec == REC_CMD && t < tick )
+		{
+			add_to_cmd_buf( s->c.buf, cmd );
+			continue;
+		}
+
+		if( rec == REC_KEYFRAME && t == tick && s->c.out_of_band )
+		{
+			clear_cmd_buf( s->c.buf );
+			memcpy( gs, s->r->map.data + s->c.offset - sizeof(struct gamestate), sizeof(struct gamestate) );
+			return;
+		}
+
+		s->c = saved;
+		break;
+	}
+
+	advance_gamestate( gs->time, tick - gs->time, s->r->step, gs, s->c.buf );
+	clear_cmd_buf( s->c.buf );
+}
+
+/* Steps both sides on a tick at a time from tick, where they agree, and
+   returns the first tick they don't, which is no later than to */
+uint32_t bisect_ticks( struct bisect_side *s, struct bisect_side *other, uint32_t tick, uint32_t to, struct gamestate *ga, struct gamestate *gb )
+{
+	bisect_state( s, tick, ga );
+	bisect_state( other, tick, gb );
+
+	while( tick < to && statehash_of( ga ) == statehash_of( gb ) )
+	{
+		tick++;
+		replay_advance( s->r, &s->c, tick, ga );
+		replay_advance( other->r, &other->c, tick, gb );
+	}
+
+	return tick;
+}
+
+/* Prints the fields that differ */
+void bisect_diff( const struct gamestate *a, const struct gamestate *b, const char *name_a, const char *name_b )
+{
+	uint64_t ha = statehash_of( a ), hb = statehash_of( b );
+
+	printf( "%-16s %20s %20s\n", "", name_a, name_b );
+	printf( "%-16s     %08x%08x     %08x%08x\n", "hash", (uint32_t)( ha >> 32 ), (uint32_t)ha, (uint32_t)( hb >> 32 ), (uint32_t)hb );
+	bisect_field( "time", a->time, b->time );
+	bisect_field( "p1 score", a->score[0], b->score[0] );
+	bisect_field( "p2 score", a->score[1], b->score[1] );
+	bisect_field( "p1 offset", SCALAR_TO_DOUBLE( a->players[0].offset ), SCALAR_TO_DOUBLE( b->players[0].offset ) );
+	bisect_field( "p1 split", SCALAR_TO_DOUBLE( a->players[0].split ), SCALAR_TO_DOUBLE( b->players[0].split ) );
+	bisect_field( "p2 offset", SCALAR_TO_DOUBLE( a->players[1].offset ), SCALAR_TO_DOUBLE( b->players[1].offset ) );
+	bisect_field( "p2 split", SCALAR_TO_DOUBLE( a->players[1].split ), SCALAR_TO_DOUBLE( b->players[1].split ) );
+	bisect_field( "ball x", SCALAR_TO_DOUBLE( a->ball.x ), SCALAR_TO_DOUBLE( b->ball.x ) );
+	bisect_field( "ball y", SCALAR_TO_DOUBLE( a->ball.y ), SCALAR_TO_DOUBLE( b->ball.y ) );
+	bisect_field( "ball xv", SCALAR_TO_DOUBLE( a->ball.xv ), SCALAR_TO_DOUBLE( b->ball.xv ) );
+	bisect_field( "ball yv", SCALAR_TO_DOUBLE( a->ball.yv ), SCALAR_TO_DOUBLE( b->ball.yv ) );
+	bisect_field( "ball colliding", a->ball.colliding, b->ball.colliding );
+}
+
+void bisect_field( const char *name, double a, double b )
+{
+	if( a != b )
+		printf( "%-16s %20.6f %20.6f\n", name, a, b );
+}
+
+enum
+{
+	VERIFY_OK = 0,
+	VERIFY_DIFFERS = 1,
+	VERIFY_UNREADABLE = 2
+};
+
+/*
+ * Re-simulates every recording in a directory and checks each one still
+ * plays out the way it was recorded, for catching physics changes that
+ * quietly break determinism before they ship.
+ *
+ * Replays are spread over a pool of threads, each starting with an even
+ * share and stealing half of whoever has the most left once it runs out,
+ * so a few long matches don't leave the other cores idle at the end.
+ * Recordings are mapped rather than read and every thread has its own
+ * command buffer; nothing else is shared while simulating.
+ */
+int verify_main( int argc, char **argv )
+{
+	struct verify_job *jobs;
+	struct verify_worker *workers;
+	struct verify_queue *queues;
+	struct verify_job *j;
+	int count, threads, i;
+	unsigned ok = 0, differs = 0, unreadable = 0, stolen = 0;
+	double ms_total = 0, bytes = 0, secs;
+	Uint64 started;
+	const char *arg;
+
+	count = verify_list( argv[2], &jobs );
+	if( count < 0 )
+	{
+		printf( "Could not list %s\n", argv[2] );
+		return 1;
+	}
+	if( count == 0 )
+	{
+		printf( "No replays in %s\n", argv[2] );
+		free( jobs );
+		return 1;
+	}
+
+	threads = SDL_GetCPUCount();
+	if( ( arg = get_option( argc, argv, "--threads" ) ) != NULL )
+		threads = atoi( arg );
+	if( threads < 1 )
+		threads = 1;
+	if( threads > VERIFY_MAX_THREADS )
+		threads = VERIFY_MAX_THREADS;
+	if( threads > count )
+		threads = count;
+
+	workers = (struct verify_worker*)calloc( threads, sizeof(struct verify_worker) );
+	queues = (struct verify_queue*)calloc( threads, sizeof(struct verify_queue) );
+
+	started = SDL_GetPerformanceCounter();
+
+	for( i = 0; i < threads; i++ )
+	{
+		queues[i].lock = SDL_CreateMutex();
+		queues[i].next = (int)( (int64_t)count * i / threads );
+		queues[i].end = (int)( (int64_t)count * ( i + 1 ) / threads );
+	}
+
+	for( i = 0; i < threads; i++ )
+	{
+		workers[i].jobs = jobs;
+		workers[i].queues = queues;
+		workers[i].count = threads;
+		workers[i].id = i;
+		workers[i].thread = SDL_CreateThread( verify_thread, "verify", &workers[i] );
+	}
+
+	for( i = 0; i < threads; i++ )
+	{
+		SDL_WaitThread( workers[i].thread, NULL );
+		stolen += workers[i].stolen;
+	}
+
+	secs = (double)( SDL_GetPerformanceCounter() - started ) / SDL_GetPerformanceFrequency();
+
+	for( i = 0; i < count; i++ )
+	{
+		j = &jobs[i];
+		ms_total += j->ticks;
+		bytes += j->len;
+
+		if( j->result == VERIFY_OK )
+		{
+			ok++;
+		}
+		else if( j->result == VERIFY_UNREADABLE )
+		{
+			unreadable++;
+		}
+		else
+		{
+			differs++;
+			printf( "%s: differs at tick %u, score %u-%u where it recorded %u-%u, hash %08x%08x where it recorded %08x%08x\n",
+				j->path, j->tick, j->got.score[0], j->got.score[1], j->want.score[0], j->want.score[1],
+				(uint32_t)( statehash_of( &j->got ) >> 32 ), (uint32_t)statehash_of( &j->got ),
+				(uint32_t)( statehash_of( &j->want ) >> 32 ), (uint32_t)statehash_of( &j->want ) );
+		}
+	}
+
+	printf( "%d replays on %d threads: %u reproduce, %u differ, %u unreadable\n", count, threads, ok, differs, unreadable );
+	printf( "%.2fs, %.1f replays/s, %.1f game hours/s, %.1fMB/s, %u steals\n", secs,
+		count / secs, ms_total / 3600000.0 / secs, bytes / ( 1024.0 * 1024.0 ) / secs, stolen );
+
+	for( i = 0; i < threads; i++ )
+	{
+		SDL_DestroyMutex( queues[i].lock );
+	}
+	for( i = 0; i < count; i++ )
+	{
+		free( jobs[i].path );
+	}
+	free( queues );
+	free( workers );
+	free( jobs );
+
+	return differs > 0 || unreadable > 0;
+}
+
+/* Fills jobs with the .rpl files in dir, in name order, and returns how
+   many there are, or -1 if the directory can't be read */
+int verify_list( const char *dir, struct verify_job **jobs )
+{
+	int count = 0, size = 64;
+	const char *name;
+	size_t len;
+#ifdef _WIN32
+	WIN32_FIND_DATAA found;
+	HANDLE find;
+	char pattern[MAX_PATH];
+
+	_snprintf( pattern, sizeof(pattern), "%s\\*.rpl", dir );
+	pattern[sizeof(pattern) - 1] = 0;
+	find = FindFirstFileA( pattern, &found );
+	if( find == INVALID_HANDLE_VALUE )
+	{
+		*jobs = NULL;
+		return GetLastError() == ERROR_FILE_NOT_FOUND ? 0 : -1;
+	}
+#else
+	DIR *d;
+	struct dirent *e;
+
+	d = opendir( dir );
+	if( d == NULL )
+	{
+		*jobs = NULL;
+		return -1;
+	}
+#endif
+
+	*jobs = (struct verify_job*)malloc( sizeof(struct verify_job) * size );
+
+#ifdef _WIN32
+	do
+	{
+		name = found.cFileName;
+#else
+	while( ( e = readdir( d ) ) != NULL )
+	{
+		name = e->d_name;
+#endif
+		len = strlen( name );
+		if( len < 4 || strcmp( name + len - 4, ".rpl" ) != 0 )
+			continue;
+
+		if( count == size )
+		{
+			size *= 2;
+			*jobs = (struct verify_job*)realloc( *jobs, sizeof(struct verify_job) * size );
+		}
+
+		memset( &(*jobs)[count], 0, sizeof(struct verify_job) );
+		(*jobs)[count].path = (char*)malloc( strlen( dir ) + len + 2 );
+		sprintf( (*jobs)[count].path, "%s/%s", dir, name );
+		count++;
+#ifdef _WIN32
+	} while( FindNextFileA( find, &found ) );
+	FindClose( find );
+#else
+	}
+	closedir( d );
+#endif
+
+	qsort( *jobs, count, sizeof(struct verify_job), verify_compare_jobs );
+	return count;
+}
+
+int verify_compare_jobs( const void *a, const void *b )
+{
+	return strcmp( ((const struct verify_job*)a)->path, ((const struct verify_job*)b)->path );
+}
+
+int verify_thread( void *ptr )
+{
+	struct verify_worker *w = (struct verify_worker*)ptr;
+	struct cmd_buf *buf = init_cmd_buf( 0xFFF );
+	int job;
+
+	while( ( job = verify_take( w ) ) >= 0 )
+	{
+		verify_replay( &w->jobs[job], buf );
+	}
+
+	free_cmd_buf( buf );
+	return 0;
+}
+
+/* The next job for a worker, or -1 once there are none left anywhere.  Jobs
+   are never added, so one pass over the others finding nothing is the end;
+   anything moved between queues while we look is in a thief's hands. */
+int verify_take( struct verify_worker *w )
+{
+	struct verify_queue *q = &w->queues[w->id], *victim;
+	int i, job = -1, take, most, n;
+
+	SDL_LockMutex( q->lock );
+	if( q->next < q->end )
+		job = q->next++;
+	SDL_UnlockMutex( q->lock );
+
+	while( job < 0 )
+	{
+		/* The fullest queue; only a guess until we hold its lock */
+		victim = NULL;
+		most = 0;
+		for( i = 0; i < w->count; i++ )
+		{
+			if( i == w->id )
+				continue;
+			SDL_LockMutex( w->queues[i].lock );
+			n = w->queues[i].end - w->queues[i].next;
+			SDL_UnlockMutex( w->queues[i].lock );
+			if( n > most )
+			{
+				most = n;
+				victim = &w->queues[i];
+			}
+		}
+		if( victim == NULL )
+			return -1;
+
+		SDL_LockMutex( victim->lock );
+		n = victim->end - victim->next;
+		take = ( n + 1 ) / 2;
+		victim->end -= take;
+		i = victim->end;
+		SDL_UnlockMutex( victim->lock );
+		if( take == 0 )
+			continue;
+
+		/* Keep the rest in our own queue, where it can be stolen in turn */
+		SDL_LockMutex( q->lock );
+		job = i;
+		q->next = i + 1;
+		q->end = i + take;
+		SDL_UnlockMutex( q->lock );
+		w->stolen++;
+	}
+
+	return job;
+}
+
+/*
+ * Plays a recording's commands through the engine from its first keyframe
+ * and compares the result with each regular keyframe and the final one.
+ * Other keyframes record things that happened outside the command stream,
+ * so those are adopted as they are, as in replay_advance().
+ */
+void verify_replay( struct verify_job *job, struct cmd_buf *buf )
+{
+	struct replay r;
+	struct replay_cursor c;
+	struct gamestate gs;
+	struct cmd cmd;
+	uint32_t t, start;
+	int rec;
+
+	if( !replay_open( &r, job->path ) )
+	{
+		job->result = VERIFY_UNREADABLE;
+		return;
+	}
+	job->len = r.map.len;
+
+	memset( &c, 0, sizeof(c) );
+	c.buf = buf;
+	memcpy( &gs, r.map.data + r.index[1] + 5, sizeof(struct gamestate) );
+	replay_cursor_reset( &c, r.index[1] + 5 + sizeof(struct gamestate), gs.time );
+	clear_cmd_buf( buf );
+	start = gs.time;
+
+	while( ( rec = replay_read( &r, &c, &cmd, &t ) ) == REC_CMD || rec == REC_KEYFRAME )
+	{
+		if( t > gs.time )
+		{
+			advance_gamestate( gs.time, t - gs.time, r.step, &gs, buf );
+			clear_cmd_buf( buf );
+		}
+
+		if( rec == REC_CMD )
+		{
+			add_to_cmd_buf( buf, cmd );
+			continue;
+		}
+
+		memcpy( &job->want, r.map.data + c.offset - sizeof(struct gamestate), sizeof(struct gamestate) );
+		if( c.out_of_band )
+		{
+			gs = job->want;
+			continue;
+		}
+
+		job->checked++;
+		if( statehash_of( &gs ) != statehash_of( &job->want ) )
+		{
+			job->result = VERIFY_DIFFERS;
+			job->tick = t;
+			break;
+		}
+	}
+
+	job->got = gs;
+	job->ticks = gs.time - start;
+	clear_cmd_buf( buf );
+	replay_close( &r );
+}
+
+int net_bind( struct net *pnet )
+{
+	SDLNet_ResolveHost( &pnet->addr, NULL, PORTNUM );
+	pnet->socket = SDLNet_UDP_Open( pnet->port );
+	if( pnet->socket == 0 )
+	{
+		printf( "%s", SDLNet_GetError() );
+		return 0;
+	}
+	
+	printf( "Bound on port: %u\n", SDLNet_Read16( &SDLNet_UDP_GetPeerAddress( pnet->socket, -1 )->port ) );
+
+	return 1;
+}
+
+/*
+ * Receives into the net's own packet and hands back a view of it, so no
+ * datagram is copied or allocated for.  Anything too short to carry a type
+ * is skipped here; the packet_*() functions check the rest.
+ */
+int net_recv( struct net *pnet, struct packet_view *v )
+{
+	int err;
+
+	if( impair.active )
+		impair_flush();
+
+	if( pnet->rx == NULL )
+		pnet->rx = SDLNet_AllocPacket( MAXPACKETSIZE );
+
+	while( ( err = SDLNet_UDP_Recv( pnet->socket, pnet->rx ) ) > 0 )
+	{
+		if( tracer.active )
+			trace_event( "recv", 'i', pnet->rx->len );
+
+		if( pnet->rx->len < (int)sizeof(uint32_t) )
+			continue;
+
+		v->data = pnet->rx->data;
+		v->len = pnet->rx->len;
+		v->type = ((const struct simple_packet*)v->data)->type;
+		v->from = pnet->rx->address;
+		return 1;
+	}
+
+	if( err == -1 )
+	{
+		printf( "%s", SDLNet_GetError() );
+	}
+
+	return 0;
+}
+
+const struct update_packet *packet_update( const struct packet_view *v )
+{
+	if( v->type != PACKET_UPDATE || v->len != sizeof(struct update_packet) )
+		return NULL;
+
+	return (const struct update_packet*)v->data;
+}
+
+const struct motion_packet *packet_motion( const struct packet_view *v )
+{
+	if( v->type != PACKET_MOTION || v->len != sizeof(struct motion_packet) )
+		return NULL;
+
+	return (const struct motion_packet*)v->data;
+}
+
+/* The event count is checked against what actually arrived */
+const struct events_packet *packet_events( const struct packet_view *v )
+{
+	const struct events_packet *ep = (const struct events_packet*)v->data;
+	int head = (int)( sizeof(struct events_packet) - sizeof(struct game_event) * EVENT_LOG );
+
+	if( v->type != PACKET_EVENTS || v->len < head || ep->count > EVENT_LOG
+		|| v->len != head + (int)( sizeof(struct game_event) * ep->count ) )
+		return NULL;
+
+	return ep;
+}
+
+const struct event_ack_packet *packet_event_ack( const struct packet_view *v )
+{
+	if( v->type != PACKET_EVENT_ACK || v->len != sizeof(struct event_ack_packet) )
+		return NULL;
+
+	return (const struct event_ack_packet*)v->data;
+}
+
+/* The command count is checked against what actually arrived */
+const struct cmd_packet *packet_cmds( const struct packet_view *v )
+{
+	const struct cmd_packet *cp = (const struct cmd_packet*)v->data;
+	int header = (int)( sizeof(struct cmd_packet) - sizeof(struct cmd) );
+
+	if( v->type != PACKET_CMD || v->len < header )
+		return NULL;
+
+	if( cp->buf.len > (uint32_t)( ( v->len - header ) / sizeof(struct cmd) ) )
+		return NULL;
+
+	return cp;
+}
+
+const struct input_packet *packet_input( const struct packet_view *v )
+{
+	const struct input_packet *ip = (const struct input_packet*)v->data;
+	int header = (int)( sizeof(struct input_packet) - LOCKSTEP_MAX_INPUTS );
+
+	if( v->type != PACKET_INPUT || v->len < header )
+		return NULL;
+
+	if( ip->count > LOCKSTEP_MAX_INPUTS || v->len < header + ip->count )
+		return NULL;
+
+	return ip;
+}
+
+const struct clock_packet *packet_clock( const struct packet_view *v )
+{
+	if( ( v->type != PACKET_PING && v->type != PACKET_PONG ) || v->len != sizeof(struct clock_packet) )
+		return NULL;
+
+	return (const struct clock_packet*)v->data;
+}
+
+/* NULL for a SYN from something that doesn't do sessions, such as a bot */
+const struct syn_packet *packet_syn( const struct packet_view *v )
+{
+	if( v->type != PACKET_SYN || v->len != sizeof(struct syn_packet) )
+		return NULL;
+
+	return (const struct syn_packet*)v->data;
+}
+
+const struct balls_packet *packet_balls( const struct packet_view *v )
+{
+	const struct balls_packet *bp = (const struct balls_packet*)v->data;
+	int header = (int)( sizeof(struct balls_packet) - sizeof(struct wire_ball) );
+
+	if( v->type != PACKET_BALLS || v->len < header )
+		return NULL;
+
+	if( bp->count < 1 || bp->count >= MULTIBALL_MAX || bp->count > (uint32_t)( ( v->len - header ) / sizeof(struct wire_ball) ) )
+		return NULL;
+
+	return bp;
+}
+
+int net_send( struct net *pnet, void *inbuf, int inlen, IPaddress to )
+{
+	UDPpacket *p;
+	int err;
+
+	if( tracer.active )
+		trace_event( "send", 'i', inlen );
+
+	if( impair.active )
+	{
+		impair_flush();
+		return impair_send( pnet->socket, inbuf, inlen, to );
+	}
+
+	p = SDLNet_AllocPacket( MAXPACKETSIZE );
+
+	p->address.host = to.host;
+	p->address.port = to.port;
+
+	memcpy( p->data, inbuf, inlen );
+
+	p->len = inlen;
+
+	err = SDLNet_UDP_Send( pnet->socket, -1, p );
+	if( err == 0 )
+	{
+		printf( "Failed to send packet: %s", SDLNet_GetError() );
+		fflush( stdout );
+	}
+
+	SDLNet_FreePacket( p );
+
+	return err;
+}
+
+/* Send a packet without game state data (syn, ack, etc) */
+int net_simple_packet( struct net *pnet, struct simple_packet *packet, IPaddress to )
+{
+	return net_send( pnet, (void*)packet, sizeof(struct simple_packet), to );
+}
+
+int net_send_update( struct net *pnet, IPaddress to, struct gamestate *gs )
+{
+	struct update_packet up;
+	up.state = *gs;
+	up.type = PACKET_UPDATE;
+	return net_send( pnet, &up, sizeof(struct update_packet), to );
+}
+
+int net_send_cmd_buf( struct net *pnet, IPaddress to, struct cmd_buf *in )
+{
+	struct cmd_packet *cp;
+	struct cmd_net_buf *nb;
+	unsigned size;
+	int err;
+
+	/* An empty buffer still goes, it's what keeps a four-client seat alive */
+	size = sizeof( struct cmd_packet ) - sizeof( struct cmd ) + ( sizeof( struct cmd ) * in->len );
+	cp = (struct cmd_packet *)malloc( size );
+	nb = cmd_to_net( in );
+
+	memcpy( &cp->buf, nb, sizeof( uint32_t ) + ( sizeof( struct cmd ) * in->len ) );
+
+	cp->type = PACKET_CMD;
+
+	err = net_send( pnet, cp, size, to );
+
+	free( nb );
+	free( cp );
+	return err;
+}
+
+struct snapshot *snapshot_new( const void *data, int len )
+{
+	struct snapshot *snap;
+
+	snap = (struct snapshot*)malloc( sizeof(struct snapshot) + len );
+	SDL_AtomicSet( &snap->refs, 1 );
+	snap->len = len;
+	memcpy( snap->data, data, len );
+
+	return snap;
+}
+
+struct snapshot *snapshot_motion( struct gamestate *gs )
+{
+	struct motion_packet mp;
+	mp.type = PACKET_MOTION;
+	mp.time = gs->time;
+	mp.players[0] = gs->players[0];
+	mp.players[1] = gs->players[1];
+	mp.ball = gs->ball;
+	return snapshot_new( &mp, sizeof(struct motion_packet) );
+}
+
+struct snapshot *snapshot_balls( uint32_t time )
+{
+	struct balls_packet *bp;
+	struct snapshot *snap;
+	int i, n = multiball.count - 1;
+	int len = (int)( sizeof(struct balls_packet) + sizeof(struct wire_ball) * ( n - 1 ) );
+
+	bp = (struct balls_packet*)malloc( len );
+	bp->type = PACKET_BALLS;
+	bp->time = time;
+	bp->count = n;
+	for( i = 0; i < n; i++ )
+	{
+		bp->balls[i].x = multiball.balls[i + 1].x;
+		bp->balls[i].y = multiball.balls[i + 1].y;
+		bp->balls[i].xv = multiball.balls[i + 1].xv;
+		bp->balls[i].yv = multiball.balls[i + 1].yv;
+		bp->balls[i].colliding = multiball.balls[i + 1].colliding;
+	}
+
+	snap = snapshot_new( bp, len );
+	free( bp );
+	return snap;
+}
+
+void snapshot_ref( struct snapshot *snap )
+{
+	SDL_AtomicAdd( &snap->refs, 1 );
+}
+
+void snapshot_unref( struct snapshot *snap )
+{
+	if( SDL_AtomicAdd( &snap->refs, -1 ) == 1 )
+	{
+		free( snap );
+	}
+}
+
+/* Spectators open with PACKET_SPECTATE, which we ACK, and go live once they
+   answer with SYNACK.  They repeat PACKET_SPECTATE as a keepalive. */
+void spectator_packet( struct net *pnet, struct spectators *sp, uint32_t type, IPaddress from )
+{
+	struct simple_packet ack_packet;
+	int i;
+
+	for( i = 0; i < sp->count; i++ )
+	{
+		if( sp->list[i].addr.host == from.host && sp->list[i].addr.port == from.port )
+			break;
+	}
+
+	if( i == sp->count )
+	{
+		if( type != PACKET_SPECTATE )
+			return;
+
+		if( sp->count == sp->cap )
+		{
+			sp->cap = sp->cap ? sp->cap * 2 : 16;
+			sp->list = (struct spectator*)realloc( sp->list, sizeof(struct spectator) * sp->cap );
+			sp->packets = (UDPpacket*)realloc( sp->packets, sizeof(UDPpacket) * sp->cap );
+			sp->vec = (UDPpacket**)realloc( sp->vec, sizeof(UDPpacket*) * sp->cap );
+		}
+
+		sp->list[i].addr = from;
+		sp->list[i].live = 0;
+		memset( &sp->list[i].ev, 0, sizeof(struct event_peer) );
+		memset( &sp->list[i].rate, 0, sizeof(struct send_rate) );
+		memset( &sp->packets[i], 0, sizeof(UDPpacket) );
+		sp->packets[i].channel = -1;
+		sp->packets[i].address = from;
+		sp->count++;
+	}
+
+	sp->list[i].last_heard = SDL_GetTicks();
+
+	if( type == PACKET_SPECTATE )
+	{
+		ack_packet.type = PACKET_ACK;
+		net_simple_packet( pnet, &ack_packet, from );
+	}
+	else if( !sp->list[i].live )
+	{
+		printf( "Spectator joined, %d watching\n", sp->count );
+		sp->list[i].live = 1;
+	}
+}
+
+void spectators_expire( struct spectators *sp )
+{
+	Uint32 now = SDL_GetTicks();
+	int i;
+
+	for( i = 0; i < sp->count; i++ )
+	{
+		if( now - sp->list[i].last_heard > SPECTATOR_TIMEOUT )
+		{
+			sp->count--;
+			sp->list[i] = sp->list[ sp->count ];
+			sp->packets[i] = sp->packets[ sp->count ];
+			i--;
+		}
+	}
+}
+
+/* Fan one snapshot out to every live spectator without copying it */
+int spectators_send( struct net *pnet, struct spectators *sp, struct snapshot *snap )
+{
+	int i, n = 0;
+
+	for( i = 0; i < sp->count; i++ )
+	{
+		if( !sp->list[i].live || ( rates.hz && !sp->list[i].rate.due ) )
+			continue;
+
+		sp->packets[i].data = snap->data;
+		sp->packets[i].len = snap->len;
+		sp->packets[i].maxlen = snap->len;
+		sp->vec[n++] = &sp->packets[i];
+	}
+
+	if( n == 0 )
+		return 0;
+
+	if( tracer.active )
+		trace_event( "fan-out", 'i', n );
+
+	if( impair.active )
+	{
+		impair_flush();
+		for( i = 0; i < n; i++ )
+			impair_send( pnet->socket, sp->vec[i]->data, sp->vec[i]->len, sp->vec[i]->address );
+		return n;
+	}
+
+	return SDLNet_UDP_SendV( pnet->socket, sp->vec, n );
+}
+
+/* The whole game, unless an event has already told us of a later score */
+void update_apply( const struct update_packet *up, struct gamestate *gs )
+{
+	*gs = up->state;
+	events.motion = up->state.time;
+
+	if( up->state.time >= events.tick )
+	{
+		events.score[0] = up->state.score[0];
+		events.score[1] = up->state.score[1];
+	}
+	else
+	{
+		gs->score[0] = events.score[0];
+		gs->score[1] = events.score[1];
+	}
+}
+
+/* A snapshot replaces all but the score, which stays as the events left it
+   rather than whatever our own prediction made of it */
+void motion_apply( const struct motion_packet *mp, struct gamestate *gs )
+{
+	gs->time = mp->time;
+	gs->players[0] = mp->players[0];
+	gs->players[1] = mp->players[1];
+	gs->ball = mp->ball;
+	gs->score[0] = events.score[0];
+	gs->score[1] = events.score[1];
+	events.motion = mp->time;
+	timesync.received++;
+}
+
+void events_push( int type, uint32_t tick, int direction, const struct gamestate *gs )
+{
+	struct game_event *e = &events.log[ events.next % EVENT_LOG ];
+
+	e->seq = events.next++;
+	e->tick = tick;
+	e->type = (uint16_t)type;
+	e->direction = (int16_t)direction;
+	e->score[0] = gs->score[0];
+	e->score[1] = gs->score[1];
+
+	if( tracer.active )
+		trace_event( "event", 'i', type );
+}
+
+/* Sends a receiver every event it hasn't acknowledged, as soon as there's
+   a new one and again every EVENT_RETRY until it does.  One that has
+   fallen further behind than the log gets what's left, which still ends
+   with the right score. */
+int events_send( struct net *pnet, struct event_peer *p, IPaddress to )
+{
+	struct events_packet ep;
+	struct game_event *e;
+	uint32_t seq = p->acked;
+	Uint32 now = SDL_GetTicks();
+
+	if( seq >= events.next )
+		return 0;
+	if( p->sent_next == events.next && now - p->sent < EVENT_RETRY )
+		return 0;
+
+	if( p->sent_next == events.next )
+		events.resent++;
+
+	if( events.next - seq > EVENT_LOG )
+		seq = events.next - EVENT_LOG;
+
+	ep.type = PACKET_EVENTS;
+	ep.epoch = events.epoch;
+	ep.count = 0;
+	for( ; seq < events.next; seq++ )
+	{
+		/* A relay that joined late has gaps */
+		e = &events.log[ seq % EVENT_LOG ];
+		if( e->type != 0 && e->seq == seq )
+			ep.events[ep.count++] = *e;
+	}
+
+	p->sent = now;
+	p->sent_next = events.next;
+
+	return net_send( pnet, &ep, (int)( sizeof(struct events_packet) - sizeof(struct game_event) * ( EVENT_LOG - ep.count ) ), to );
+}
+
+/* Each seat's and spectator's share; the classic joiner's is sent along
+   with its snapshots */
+void events_flush( struct net *pnet )
+{
+	int i;
+
+	for( i = 1; i < seats.count; i++ )
+	{
+		if( seats.list[i].live )
+			events_send( pnet, &seats.list[i].ev, seats.list[i].addr );
+	}
+
+	for( i = 0; i < spectators.count; i++ )
+	{
+		if( spectators.list[i].live )
+			events_send( pnet, &spectators.list[i].ev, spectators.list[i].addr );
+	}
+}
+
+/* Takes the events we haven't seen, in order, and says how far we've got.
+   A relay passes NULL, only keeping them to pass on. */
+void events_recv( struct net *pnet, const struct packet_view *v, struct gamestate *gs )
+{
+	const struct events_packet *ep = packet_events( v );
+	const struct game_event *e;
+	struct event_ack_packet ack;
+	uint32_t i;
+
+	if( ep == NULL )
+		return;
+
+	if( ep->epoch != events.epoch )
+		events_restart( ep->epoch );
+
+	for( i = 0; i < ep->count; i++ )
+	{
+		e = &ep->events[i];
+		if( e->seq < events.next )
+			continue;
+
+		events.log[ e->seq % EVENT_LOG ] = *e;
+		events.next = e->seq + 1;
+		events.tick = e->tick;
+		events.score[0] = e->score[0];
+		events.score[1] = e->score[1];
+
+		if( gs == NULL )
+			continue;
+
+		gs->score[0] = e->score[0];
+		gs->score[1] = e->score[1];
+
+		/* A serve the snapshots haven't shown us yet goes on the ball
+		   now, and the next snapshot puts it exactly where it should be */
+		if( e->type != EVENT_SCORE && e->tick > events.motion && e->tick <= gs->time )
+		{
+			reset_ball( &gs->ball );
+			gs->ball.xv = INT_TO_SCALAR( BALL_SPEED * e->direction );
+		}
+	}
+
+	ack.type = PACKET_EVENT_ACK;
+	ack.next = events.next;
+	net_send( pnet, &ack, sizeof(ack), v->from );
+}
+
+/* A host that has started over numbers its events from 0 again, so the log
+   goes, along with how far a relay's own spectators had got through it */
+void events_restart( uint32_t epoch )
+{
+	int i;
+
+	memset( events.log, 0, sizeof(events.log) );
+	events.epoch = epoch;
+	events.next = 0;
+	events.tick = 0;
+	events.score[0] = 0;
+	events.score[1] = 0;
+
+	for( i = 0; i < spectators.count; i++ )
+		memset( &spectators.list[i].ev, 0, sizeof(struct event_peer) );
+}
+
+/* Whose events an acknowledgement is for, NULL if nobody's */
+struct event_peer *events_peer( IPaddress from )
+{
+	int i;
+
+	if( net.type == NET_HOST && !seats.count && !lockstep.active
+		&& from.host == net.addr.host && from.port == net.addr.port )
+		return &events.joiner;
+
+	if( ( i = seat_find( from ) ) != 0 )
+		return &seats.list[i].ev;
+
+	for( i = 0; i < spectators.count; i++ )
+	{
+		if( spectators.list[i].addr.host == from.host && spectators.list[i].addr.port == from.port )
+			return &spectators.list[i].ev;
+	}
+
+	return NULL;
+}
+
+void events_acked( struct event_peer *p, const struct packet_view *v )
+{
+	const struct event_ack_packet *ack = packet_event_ack( v );
+
+	if( p != NULL && ack != NULL && ack->next > p->acked && ack->next <= events.next )
+		p->acked = ack->next;
+}
+
+/* Decides once a frame who gets this frame's snapshots, so chaos mode's
+   balls go out with the update they belong to */
+void rates_frame( int joiner_live )
+{
+	Uint32 now = SDL_GetTicks();
+	int i;
+
+	if( !rates.hz )
+		return;
+
+	if( !seats.count && joiner_live )
+		rate_due( &rates.joiner, now );
+
+	for( i = 1; i < seats.count; i++ )
+	{
+		if( seats.list[i].live )
+			rate_due( &seats.list[i].rate, now );
+	}
+
+	for( i = 0; i < spectators.count; i++ )
+	{
+		if( spectators.list[i].live )
+			rate_due( &spectators.list[i].rate, now );
+	}
+}
+
+int rate_due( struct send_rate *r, Uint32 now )
+{
+	if( r->hz == 0 )
+	{
+		r->hz = rates.hz;
+		r->next = now;
+	}
+
+	r->due = (int32_t)( now - r->next ) >= 0;
+	if( r->due )
+	{
+		/* A slow frame doesn't earn a burst to catch up */
+		r->next += 1000 / r->hz;
+		if( (int32_t)( now - r->next ) >= 0 )
+			r->next = now + 1000 / r->hz;
+		r->sent++;
+	}
+
+	return r->due;
+}
+
+/* Whose snapshots a ping speaks for, NULL if nobody's */
+struct send_rate *rate_find( IPaddress from )
+{
+	int i;
+
+	if( !seats.count && !lockstep.active && from.host == net.addr.host && from.port == net.addr.port )
+		return &rates.joiner;
+
+	if( ( i = seat_find( from ) ) != 0 )
+		return &seats.list[i].rate;
+
+	for( i = 0; i < spectators.count; i++ )
+	{
+		if( spectators.list[i].addr.host == from.host && spectators.list[i].addr.port == from.port )
+			return &spectators.list[i].rate;
+	}
+
+	return NULL;
+}
+
+/*
+ * Each ping is a chance to judge a connection's rate.  Loss is what the
+ * pinger says it has had against what we've sent since the last verdict.
+ * Snapshots still in flight are missing from both counts, which cancels
+ * out while the round trip holds steady.  A round trip well over the best
+ * seen means a queue is building on the way, which is worth backing off
+ * for before it starts to drop.
+ */
+void rate_report( struct send_rate *r, const struct clock_packet *ping )
+{
+	uint32_t sent, got, lost, floor;
+	Uint32 now = SDL_GetTicks();
+	int bad;
+
+	if( r == NULL || r->hz == 0 )
+		return;
+
+	if( ping->rtt && ( r->best_rtt == 0 || ping->rtt < r->best_rtt ) )
+		r->best_rtt = ping->rtt;
+
+	sent = r->sent - r->sent_then;
+	got = ping->received - r->received_then;
+	lost = got < sent ? sent - got : 0;
+	bad = ( sent >= RATE_SAMPLE && lost * 100 > sent * RATE_LOSS_PERCENT ) || ping->rtt > r->best_rtt + RATE_QUEUE_MS;
+
+	/* The first report is only a starting point */
+	if( r->reports++ > 0 )
+	{
+		if( !bad && sent < RATE_SAMPLE )
+			return; /* not enough to go on yet */
+
+		if( !bad )
+		{
+			r->hz = r->hz + RATE_STEP_HZ < rates.hz ? r->hz + RATE_STEP_HZ : rates.hz;
+		}
+		else if( (int32_t)( now - r->held ) >= 0 )
+		{
+			floor = rates.hz < RATE_MIN_HZ ? rates.hz : RATE_MIN_HZ;
+			r->hz = r->hz / 2 > floor ? r->hz / 2 : floor;
+			r->held = now + RATE_HOLD_MS;
+			rates.backoffs++;
+		}
+	}
+
+	r->sent_then = r->sent;
+	r->received_then = ping->received;
+}
+
+/* Four-client mode's keys for one paddle: up and down for the side
+   paddles, A and D for the top and bottom ones */
+void paddle_move_cmd( int paddle, struct cmd_buf *buf )
+{
+	struct cmd tc;
+	int minus = paddle % 2 ? input_status[3] : input_status[0];
+	int plus = paddle % 2 ? input_status[2] : input_status[1];
+
+	if( minus )
+	{
+		player_move_cmd( &tc, CMD_PADDLE1_MOVE + paddle, SCALAR_PER_MS( INT_TO_SCALAR( -PADDLE_SPEED ), delta ) );
+		add_to_cmd_buf( buf, tc );
+	}
+
+	if( plus )
+	{
+		player_move_cmd( &tc, CMD_PADDLE1_MOVE + paddle, SCALAR_PER_MS( INT_TO_SCALAR( PADDLE_SPEED ), delta ) );
+		add_to_cmd_buf( buf, tc );
+	}
+}
+
+/* The seat a joiner has, 0 for none */
+int seat_find( IPaddress from )
+{
+	int s;
+
+	for( s = 1; s < seats.count; s++ )
+	{
+		if( seats.list[s].taken && seats.list[s].addr.host == from.host && seats.list[s].addr.port == from.port )
+			return s;
+	}
+
+	return 0;
+}
+
+/*
+ * The four-client host's share of what comes in: joiners asking for a
+ * paddle, and the moves of those that have one.  A seat's moves only ever
+ * steer its own paddle.  Returns 0 for spectator traffic, which the caller
+ * deals with as usual.
+ */
+int seats_recv( struct net *pnet, const struct packet_view *v, struct cmd_buf *buf )
+{
+	const struct cmd_packet *cp;
+	const struct syn_packet *syn;
+	struct seat_packet ack;
+	struct seat *seat;
+	int s = seat_find( v->from );
+	uint32_t i;
+
+	/* Answered the same as anyone else's */
+	if( v->type == PACKET_PING || v->type == PACKET_EVENT_ACK )
+		return 0;
+
+	if( v->type == PACKET_SYN )
+	{
+		syn = packet_syn( v );
+
+		/* Someone coming back with their session gets their seat back
+		   wherever they are now */
+		for( i = 1; s == 0 && syn != NULL && syn->token != 0 && i < (uint32_t)seats.count; i++ )
+		{
+			if( seats.list[i].taken && seats.list[i].token == syn->token )
+			{
+				s = i;
+				seats.list[s].addr = v->from;
+				printf( "Paddle %d resumed\n", s + 1 );
+			}
+		}
+
+		/* A repeated SYN means our ACK was lost, so it gets the same seat */
+		if( s == 0 )
+		{
+			for( s = 1; s < seats.count && seats.list[s].taken; s++ )
+			{
+			}
+
+			if( s == seats.count )
+			{
+				s = 0;
+			}
+			else
+			{
+				memset( &seats.list[s], 0, sizeof(struct seat) );
+				seats.list[s].addr = v->from;
+				seats.list[s].taken = 1;
+				seats.list[s].token = syn ? syn->token : 0;
+				printf( "Player joined on paddle %d\n", s + 1 );
+			}
+		}
+		else
+		{
+			/* The next update they'd get is the whole game anyway, but
+			   they needn't wait a frame for it */
+			net_send_update( pnet, v->from, &local_state );
+		}
+
+		if( s )
+			seats.list[s].last_heard = SDL_GetTicks();
+
+		ack.type = PACKET_ACK;
+		ack.seat = s;
+		net_send( pnet, &ack, sizeof(ack), v->from );
+		return 1;
+	}
+
+	if( s == 0 )
+		return v->type == PACKET_CMD; /* no seat, no say */
+
+	seat = &seats.list[s];
+	seat->last_heard = SDL_GetTicks();
+	seat->live = 1;
+
+	cp = packet_cmds( v );
+	for( i = 0; cp != NULL && i < cp->buf.len; i++ )
+	{
+		if( cp->buf.cmds[i].type == (uint32_t)( CMD_PADDLE1_MOVE + s ) )
+			remote_cmd( buf, cp->buf.cmds[i] );
+	}
+
+	return 1;
+}
+
+/* A seat that goes quiet stops being sent to, but is held for a while in
+   case its player resumes.  One without a session can't resume, so it is
+   sent to and then let go just as a spectator would be. */
+void seats_expire()
+{
+	Uint32 now = SDL_GetTicks();
+	struct seat *seat;
+	int s, i;
+
+	for( s = 1; s < seats.count; s++ )
+	{
+		seat = &seats.list[s];
+		if( !seat->taken )
+			continue;
+
+		if( seat->live && seat->token && now - seat->last_heard > PEER_TIMEOUT )
+		{
+			printf( "Paddle %d has gone quiet\n", s + 1 );
+			seat->live = 0;
+			for( i = 0; i < seat->queued; i++ )
+				snapshot_unref( seat->queue[i] );
+			seat->queued = 0;
+		}
+
+		if( now - seat->last_heard <= ( seat->token ? SESSION_TIMEOUT : SPECTATOR_TIMEOUT ) )
+			continue;
+
+		printf( "Paddle %d is free again\n", s + 1 );
+		lagcomp.rewind[s] = 0;
+		memset( seat, 0, sizeof(struct seat) );
+	}
+}
+
+/* Puts a packet on every live seat's queue.  A full queue loses its oldest,
+   which anything newer makes out of date anyway. */
+void seats_queue( struct snapshot *snap )
+{
+	struct seat *seat;
+	int s;
+
+	for( s = 1; s < seats.count; s++ )
+	{
+		seat = &seats.list[s];
+		if( !seat->live || ( rates.hz && !seat->rate.due ) )
+			continue;
+
+		if( seat->queued == SEAT_QUEUE )
+		{
+			snapshot_unref( seat->queue[0] );
+			memmove( seat->queue, seat->queue + 1, sizeof(struct snapshot*) * ( SEAT_QUEUE - 1 ) );
+			seat->queued--;
+			seat->dropped++;
+		}
+
+		snapshot_ref( snap );
+		seat->queue[seat->queued++] = snap;
+	}
+}
+
+/* Sends what every seat has queued in one go.  Whatever a seat couldn't
+   send stays at the front of its own queue for next time. */
+int seats_flush( struct net *pnet )
+{
+	struct seat *seat;
+	UDPpacket *pkt;
+	int s, i, sent, n = 0, total = 0;
+
+	for( s = 1; s < seats.count; s++ )
+	{
+		seat = &seats.list[s];
+		for( i = 0; seat->live && i < seat->queued; i++ )
+		{
+			pkt = &seats.packets[n];
+			pkt->channel = -1;
+			pkt->address = seat->addr;
+			pkt->data = seat->queue[i]->data;
+			pkt->len = seat->queue[i]->len;
+			pkt->maxlen = seat->queue[i]->len;
+			pkt->status = 0;
+			seats.vec[n++] = pkt;
+		}
+	}
+
+	if( n == 0 )
+		return 0;
+
+	if( tracer.active )
+		trace_event( "fan-out", 'i', n );
+
+	if( impair.active )
+	{
+		impair_flush();
+		for( i = 0; i < n; i++ )
+		{
+			impair_send( pnet->socket, seats.vec[i]->data, seats.vec[i]->len, seats.vec[i]->address );
+			seats.vec[i]->status = seats.vec[i]->len;
+		}
+	}
+	else
+	{
+		SDLNet_UDP_SendV( pnet->socket, seats.vec, n );
+	}
+
+	n = 0;
+	for( s = 1; s < seats.count; s++ )
+	{
+		seat = &seats.list[s];
+		if( !seat->live )
+			continue;
+
+		/* Only a run from the front counts, to keep the queue in order */
+		for( i = 0, sent = 0; i < seat->queued; i++, n++ )
+		{
+			if( sent == i && seats.vec[n]->status >= 0 )
+				sent++;
+		}
+
+		for( i = 0; i < sent; i++ )
+			snapshot_unref( seat->queue[i] );
+		memmove( seat->queue, seat->queue + sent, sizeof(struct snapshot*) * ( seat->queued - sent ) );
+		seat->queued -= sent;
+		total += sent;
+	}
+
+	return total;
+}
+
+/* Remote commands are stamped on the host's timeline, but one that turns
+   up after its tick has been simulated would never run, and one stamped
+   ahead of us would be cleared before its tick came round.  Either way it
+   is moved to the nearest tick we're still going to simulate. */
+void remote_cmd( struct cmd_buf *buf, struct cmd c )
+{
+	uint32_t now = SDL_GetTicks() - start_time;
+
+	if( (int32_t)( c.time - local_state.time ) < 0 )
+	{
+		c.time = local_state.time;
+		timesync.late++;
+	}
+	else if( (int32_t)( c.time - now ) >= 0 )
+	{
+		c.time = now > local_state.time ? now - 1 : local_state.time;
+		timesync.early++;
+	}
+
+	add_to_cmd_buf( buf, c );
+}
+
+/* Pings the host now and then, more often until the filter has a full
+   window to choose from */
+void timesync_ping( struct net *pnet )
+{
+	struct clock_packet ping;
+	Uint32 now = SDL_GetTicks();
+
+	if( now - timesync.last_ping < ( timesync.count < CLOCK_SAMPLES ? CLOCK_BURST_MS : CLOCK_PING_MS ) )
+		return;
+
+	memset( &ping, 0, sizeof(ping) );
+	ping.type = PACKET_PING;
+	ping.seq = ++timesync.seq;
+	ping.sent = now;
+	ping.rtt = timesync.srtt;
+	ping.received = timesync.received;
+	net_send( pnet, &ping, sizeof(ping), pnet->addr );
+	timesync.last_ping = now;
+}
+
+void timesync_pong( struct net *pnet, const struct packet_view *v )
+{
+	struct clock_packet pong;
+	const struct clock_packet *ping = packet_clock( v );
+
+	if( ping == NULL || ping->type != PACKET_PING )
+		return;
+
+	if( ping->rtt )
+		lagcomp_rtt( v->from, ping->rtt );
+
+	if( rates.hz )
+		rate_report( rate_find( v->from ), ping );
+
+	pong = *ping;
+	pong.type = PACKET_PONG;
+	pong.host_recv = SDL_GetTicks() - start_time;
+	pong.host_sent = pong.host_recv;
+	net_send( pnet, &pong, sizeof(pong), v->from );
+}
+
+void timesync_recv( const struct clock_packet *cp )
+{
+	Uint32 now = SDL_GetTicks();
+	struct clock_sample *sample;
+	int i, n;
+
+	/* Throw away anything we didn't send, or that's older than our window */
+	if( cp->type != PACKET_PONG || cp->seq > timesync.seq || timesync.seq - cp->seq >= CLOCK_SAMPLES )
+		return;
+	if( now - cp->sent > 60000 || cp->host_sent - cp->host_recv > now - cp->sent )
+		return;
+
+	sample = &timesync.samples[timesync.count % CLOCK_SAMPLES];
+	sample->rtt = ( now - cp->sent ) - ( cp->host_sent - cp->host_recv );
+	sample->offset = ( (int32_t)( cp->host_recv - cp->sent ) + (int32_t)( cp->host_sent - now ) ) / 2;
+	timesync.count++;
+
+	if( timesync.count == 1 )
+		timesync.srtt = sample->rtt;
+	else
+		timesync.srtt += ( (int32_t)( sample->rtt - timesync.srtt ) ) / 8;
+
+	n = timesync.count < CLOCK_SAMPLES ? timesync.count : CLOCK_SAMPLES;
+	sample = &timesync.samples[0];
+	for( i = 1; i < n; i++ )
+	{
+		if( timesync.samples[i].rtt < sample->rtt )
+			sample = &timesync.samples[i];
+	}
+	timesync.offset = sample->offset;
+	timesync.rtt = sample->rtt;
+
+	if( timesync.count == CLOCK_SAMPLES )
+	{
+		printf( "Clock synced: host is %+dms from us, %ums round trip\n", timesync.offset, timesync.rtt );
+	}
+}
+
+/* Now, on the host's game clock */
+uint32_t timesync_now()
+{
+	return SDL_GetTicks() + timesync.offset;
+}
+
+/* Sets how far back to judge a remote player's paddle, from their pings */
+void lagcomp_rtt( IPaddress from, uint32_t rtt )
+{
+	uint32_t rewind = rtt / 2;
+	int s;
+
+	if( lagcomp.owner == NULL )
+		return;
+
+	if( rewind > lagcomp.max_ms )
+		rewind = lagcomp.max_ms;
+	if( rewind > ( LAGCOMP_HISTORY - 1 ) * physics_step )
+		rewind = ( LAGCOMP_HISTORY - 1 ) * physics_step;
+
+	if( seats.count )
+	{
+		s = seat_find( from );
+		if( s )
+			lagcomp.rewind[s] = rewind;
+	}
+	else if( from.host == net.addr.host && from.port == net.addr.port )
+	{
+		/* The classic joiner has both of player 2's paddles */
+		lagcomp.rewind[1] = rewind;
+		lagcomp.rewind[3] = rewind;
+	}
+}
+
+/* Runs after the ball's move each physics step: gives a remote paddle any
+   hit it saw that we missed, then remembers where the ball ended up.
+   Returns whether it gave one. */
+int lagcomp_step( struct gamestate *gs, uint32_t tick, uint32_t step )
+{
+	const struct ball_history *h, *prev;
+	struct ball_history *e;
+	SDL_Rect paddles[4], *paddle;
+	int p, saved = 0;
+
+	paddle_rects( gs, paddles );
+
+	for( p = 0; p < 4; p++ )
+	{
+		if( lagcomp.rewind[p] == 0 )
+			continue;
+
+		h = lagcomp_at( tick - lagcomp.rewind[p], step );
+		if( h == NULL )
+			continue;
+
+		/* Heading their way then and now, or they've already had their bounce */
+		if( !lagcomp_toward( p, h->xv, h->yv ) || !lagcomp_toward( p, gs->ball.xv, gs->ball.yv ) )
+			continue;
+
+		paddle = &paddles[p];
+		if( !lagcomp_touching( h, paddle ) )
+			continue;
+
+		/* Back up to where they first touched, which is the hit they saw */
+		while( ( prev = lagcomp_at( h->tick - step, step ) ) != NULL && lagcomp_touching( prev, paddle ) )
+			h = prev;
+
+		/* Bounce it from there and bring it back up to now */
+		gs->ball.x = h->x;
+		gs->ball.y = h->y;
+		bounce_ball( &gs->ball, paddle );
+		gs->ball.x += SCALAR_PER_MS( gs->ball.xv, tick - h->tick );
+		gs->ball.y += SCALAR_PER_MS( gs->ball.yv, tick - h->tick );
+		gs->ball.colliding = 1;
+		lagcomp.saves++;
+		saved = 1;
+		break;
+	}
+
+	e = &lagcomp.history[( tick / step ) % LAGCOMP_HISTORY];
+	e->tick = tick;
+	e->x = gs->ball.x;
+	e->y = gs->ball.y;
+	e->xv = gs->ball.xv;
+	e->yv = gs->ball.yv;
+	return saved;
+}
+
+/* The ball as of the last physics step at or before tick, if still held */
+const struct ball_history *lagcomp_at( uint32_t tick, uint32_t step )
+{
+	const struct ball_history *e;
+
+	tick -= tick % step;
+	e = &lagcomp.history[( tick / step ) % LAGCOMP_HISTORY];
+	return e->tick == tick ? e : NULL;
+}
+
+int lagcomp_touching( const struct ball_history *h, SDL_Rect *paddle )
+{
+	return h->x < INT_TO_SCALAR( paddle->x + paddle->w ) && h->x + INT_TO_SCALAR( BALL_SIZE ) > INT_TO_SCALAR( paddle->x ) &&
+		h->y < INT_TO_SCALAR( paddle->y + paddle->h ) && h->y + INT_TO_SCALAR( BALL_SIZE ) > INT_TO_SCALAR( paddle->y );
+}
+
+/* Whether a ball moving this way is heading for a paddle's wall */
+int lagcomp_toward( int paddle, scalar xv, scalar yv )
+{
+	switch( paddle )
+	{
+	case 0:
+		return xv < 0;
+	case 1:
+		return yv < 0;
+	case 2:
+		return xv > 0;
+	default:
+		return yv > 0;
+	}
+}
+
+/* A joiner's new session.  It only has to tell us apart from whoever else
+   joins the same host, so the performance counter is random enough. */
+uint32_t session_token()
+{
+	uint32_t seed = (uint32_t)SDL_GetPerformanceCounter() ^ ( (uint32_t)net.port << 16 ) ^ SDL_GetTicks();
+	uint32_t token;
+
+	do
+	{
+		token = bot_rand( &seed );
+	} while( token == 0 );
+
+	return token;
+}
+
+/* Anything from the other end of a classic game shows it's still there */
+void session_heard( IPaddress from )
+{
+	if( from.host != net.addr.host || from.port != net.addr.port )
+		return;
+
+	if( session.lost )
+	{
+		printf( net.type == NET_HOST ? "Player 2 is back after %u ms\n" : "Back in the game after %u ms\n",
+			SDL_GetTicks() - session.last_heard );
+	}
+
+	session.last_heard = SDL_GetTicks();
+	session.lost = 0;
+}
+
+/* Called every frame.  Returns 0 while the other end has gone quiet, and
+   until it answers a joiner keeps asking to resume its session.  A host
+   keeps sending to a joiner without a session, such as a bot, which may
+   only speak up when it moves and couldn't come back anyway. */
+int session_check( struct net *pnet )
+{
+	struct syn_packet syn;
+	Uint32 now = SDL_GetTicks();
+
+	if( pnet->type == NET_HOST && session.token == 0 )
+		return 1;
+
+	if( !session.lost && now - session.last_heard > ( pnet->type == NET_HOST ? PEER_TIMEOUT : RESUME_AFTER ) )
+	{
+		printf( pnet->type == NET_HOST ? "Player 2 has gone quiet\n" : "Lost the host, trying to resume\n" );
+		session.lost = 1;
+	}
+
+	if( session.lost && pnet->type == NET_JOIN && now - session.last_knock > HANDSHAKE_RETRY )
+	{
+		syn.type = PACKET_SYN;
+		syn.token = session.token;
+		net_send( pnet, &syn, sizeof(syn), pnet->addr );
+		session.last_knock = now;
+	}
+
+	return !session.lost;
+}
+
+/* A classic host's joiner asking for its paddle back, maybe from a new
+   address.  Anyone else asking mid-game is ignored, as before. */
+void session_resume( struct net *pnet, const struct packet_view *v )
+{
+	const struct syn_packet *syn = packet_syn( v );
+	struct simple_packet ack;
+
+	if( syn == NULL || syn->token == 0 || syn->token != session.token )
+		return;
+
+	if( v->from.host != pnet->addr.host || v->from.port != pnet->addr.port )
+	{
+		printf( "Player 2 resumed from a new address\n" );
+		pnet->addr = v->from;
+		session_heard( v->from );
+	}
+
+	ack.type = PACKET_ACK;
+	net_simple_packet( pnet, &ack, v->from );
+	net_send_update( pnet, v->from, &local_state );
+}
+
+/* The host's answer to a resume.  A four-client host that gave our seat
+   away while we were gone seats us afresh, if it can.  Returns 0 if it
+   couldn't. */
+int session_ack( struct net *pnet, const struct packet_view *v )
+{
+	const struct seat_packet *sp = (const struct seat_packet*)v->data;
+
+	if( v->len < (int)sizeof(struct seat_packet) || (int)sp->seat == pnet->seat )
+		return 1;
+
+	if( sp->seat == 0 || sp->seat >= SEATS )
+	{
+		printf( "Our seat has gone and the game is full\n" );
+		return 0;
+	}
+
+	pnet->seat = sp->seat;
+	printf( "Playing paddle %d\n", pnet->seat + 1 );
+	return 1;
+}
+
+/*int net_thread( void *ptr )
+{
+	uint8_t buf[MAXPACKETSIZE];
+	int buflen = MAXPACKETSIZE;
+	int recvbytes;
+	struct net *pnet = (struct net*)ptr;
+	IPaddress ip;
+	struct simple_packet *sp;
+	struct update_packet *up;
+	struct cmd_packet *cp;
+	int i;
+
+	while( running )
+	{
+		if( !net_recv( pnet, (void*)buf, buflen, &recvbytes, &ip ) )
+		{
+			continue;
+		}
+
+		sp = (struct simple_packet*)buf;
+
+		printf( "Packet received!\n" );  
+
+		switch( pnet->state )
+		{
+		case NET_STATE_WAIT_SYN:
+			if( sp->type == PACKET_SYN )
+			{
+				printf( "SYN received, sending ACK\n" );
+				pnet->addr.host = ip.host;
+				net_simple_packet( pnet, PACKET_ACK, pnet->addr );
+				pnet->state = NET_STATE_WAIT_SYNACK;
+			}
+			break;
+		case NET_STATE_WAIT_ACK:
+			if( sp->type == PACKET_ACK )
+			{
+				printf( "ACK received, sending SYNACK\n" );
+				net_simple_packet( pnet, PACKET_SYNACK, pnet->addr );
+				pnet->state = NET_STATE_GAME;
+			}
+			break;
+		case NET_STATE_WAIT_SYNACK:
+			if( sp->type == PACKET_SYNACK )
+			{
+				printf( "Got SYNACK\n" );
+				pnet->state = NET_STATE_GAME;
+				net_send_update( pnet, pnet->addr );
+			}
+			break;
+		case NET_STATE_GAME:
+			if( pnet->state == NET_JOIN && sp->type == PACKET_UPDATE )
+			{
+				up = (struct update_packet*)sp;
+				local_state = up->state;
+			}
+
+			if( pnet->state == NET_HOST && sp->type == PACKET_CMD )
+			{
+				cp = (struct cmd_packet*)sp;
+				for( i = 0; i < cp->buf.len; i++ )
+				{
+					add_to_cmd_buf( local_cmd_buf, cp->buf.cmds[i] );
+				}
+			}
+			break;
+		}
+
+		memset( buf, 0, MAXPACKETSIZE );
+	}
+
+	return 0;
+}*/
+
+/*void net_create_thread( struct net *pnet )
+{
+	SDL_CreateThread(net_thread, "net", pnet);
+}*/
+
+int main( int argc, char **argv )
+{
+	struct simple_packet sp;
+	const char *opt;
+
+	sp.type = PACKET_SYN;
+	running = 1;
+
+	if( !impair_init( argc, argv ) )
+	{
+		return 1;
+	}
+
+	opt = get_option( argc, argv, "--timers" );
+	if( opt )
+	{
+		timers_init( atoi( opt ) * 1000 );
+	}
+
+	opt = get_option( argc, argv, "--trace" );
+	if( opt )
+	{
+		trace_init( opt );
+	}
+
+	opt = get_option( argc, argv, "--tick" );
+	if( opt )
+	{
+		physics_step = atoi( opt );
+		if( physics_step < 1 || physics_step > 100 )
+		{
+			printf( "The physics tick must be from 1 to 100ms\n" );
+			return 1;
+		}
+	}
+
+	opt = get_option( argc, argv, "--keyframe" );
+	if( opt && ( atoi( opt ) < 1 || atoi( opt ) > 600 ) )
+	{
+		printf( "Keyframes must be from 1 to 600 seconds apart\n" );
+		return 1;
+	}
+
+	if( argc > 2 && strcmp( "replay", argv[1] ) == 0 )
+	{
+		return tool_exit( replay_main( argc, argv ) );
+	}
+
+	if( argc > 2 && strcmp( "bisect", argv[1] ) == 0 )
+	{
+		return tool_exit( bisect_main( argc, argv ) );
+	}
+
+	if( argc > 2 && strcmp( "verify", argv[1] ) == 0 )
+	{
+		return tool_exit( verify_main( argc, argv ) );
+	}
+
+	if( argc > 2 && strcmp( "bot", argv[1] ) == 0 )
+	{
+		return tool_exit( bot_main( argc, argv ) );
+	}
+
+	if( argc > 1 && strcmp( "loadgen", argv[1] ) == 0 )
+	{
+		return tool_exit( loadgen_main( argc, argv ) );
+	}
+
+	if( argc > 1 && strncmp( argv[1], "--", 2 ) != 0 )
+	{
+		if( strcmp( "join", argv[1] ) == 0 )
+		{
+			if( argc < 3 )
+			{
+				printf( "Please specify a host to connect to!\n" );
+				return 1;
+			}
+			net.type = NET_JOIN;
+			net.port = PORTNUM;
+		}
+		else if( strcmp( "host", argv[1] ) == 0 )
+		{
+			net.type = NET_HOST;
+			net.port = PORTNUM;
+		}
+		else if( strcmp( "spectate", argv[1] ) == 0 )
+		{
+			if( argc < 3 )
+			{
+				printf( "Please specify a host to watch!\n" );
+				return 1;
+			}
+			net.type = NET_SPECTATE;
+		}
+		else if( strcmp( "relay", argv[1] ) == 0 )
+		{
+			if( argc < 3 )
+			{
+				printf( "Please specify an upstream host to relay!\n" );
+				return 1;
+			}
+			net.type = NET_RELAY;
+			net.port = PORTNUM;
+		}
+		else
+		{
+			printf( "Unknown argument!\n" );
+			return 1;
+		}
+
+		opt = get_option( argc, argv, "--port" );
+		if( opt )
+		{
+			net.port = atoi( opt );
+		}
+
+		opt = get_option( argc, argv, "--seats" );
+		if( opt && net.type == NET_HOST )
+		{
+			if( atoi( opt ) < 2 || atoi( opt ) > SEATS )
+			{
+				printf( "There are only seats for 2 to %d players\n", SEATS );
+				return 1;
+			}
+			seats.count = atoi( opt );
+		}
+
+		opt = get_option( argc, argv, "--rate" );
+		if( opt && net.type == NET_HOST && ( atoi( opt ) < 0 || atoi( opt ) > 1000 ) )
+		{
+			printf( "The update rate must be from 0 to 1000 a second\n" );
+			return 1;
+		}
+
+		if( !net_init() )
+		{
+			printf( "Could not init network, exiting!\n" );
+			return 1;
+		}
+
+		if( net.type != NET_HOST && !resolve_addr( &net.addr, argv[2] ) )
+		{
+			printf( "Could not resolve %s\n", argv[2] );
+			return 1;
+		}
+
+		/* A restarted joiner picks up where it left off with the session it
+		   was given last time */
+		if( net.type == NET_JOIN )
+		{
+			opt = get_option( argc, argv, "--resume" );
+			session.token = opt ? (uint32_t)strtoul( opt, NULL, 16 ) : session_token();
+		}
+
+		if( !net_wait_for_game( &net ) )
+		{
+			return 1;
+		}
+
+		if( net.type == NET_JOIN )
+		{
+			printf( "Session %08x, rejoin with --resume %08x\n", session.token, session.token );
+		}
+	}
+	else
+	{
+		net.type = NET_LOCAL;
+	}
+
+	opt = get_option( argc, argv, "--lockstep" );
+	if( opt && ( net.type == NET_HOST || net.type == NET_JOIN ) )
+	{
+		if( seats.count || net.seat )
+		{
+			printf( "Lockstep is for two players only\n" );
+			return 1;
+		}
+		if( atoi( opt ) < 0 || atoi( opt ) > LOCKSTEP_MAX_INPUTS )
+		{
+			printf( "Input delay must be from 0 to %d ticks\n", LOCKSTEP_MAX_INPUTS );
+			return 1;
+		}
+		lockstep_init( net.type == NET_HOST ? 0 : 1, atoi( opt ) );
+	}
+
+	/* Lockstep peers each run the game, so there's nobody to compensate */
+	opt = get_option( argc, argv, "--lagcomp" );
+	if( net.type == NET_HOST && !lockstep.active && ( opt == NULL || atoi( opt ) > 0 ) )
+	{
+		memset( lagcomp.history, 0xFF, sizeof(lagcomp.history) );
+		lagcomp.owner = &local_state;
+		lagcomp.max_ms = opt ? atoi( opt ) : LAGCOMP_MAX_MS;
+		if( lagcomp.max_ms > (uint32_t)LAGCOMP_REACH_MS )
+		{
+			printf( "Lag compensation only reaches back %dms, before the ball scores\n", LAGCOMP_REACH_MS );
+			lagcomp.max_ms = LAGCOMP_REACH_MS;
+		}
+	}
+
+	/* Clients and spectators pick chaos mode up from the host */
+	opt = get_option( argc, argv, "--balls" );
+	if( opt && atoi( opt ) > 1 && net.type != NET_RELAY )
+	{
+		if( atoi( opt ) > MULTIBALL_MAX )
+		{
+			printf( "Chaos mode takes at most %d balls\n", MULTIBALL_MAX );
+			return 1;
+		}
+		multiball_init( &local_state, atoi( opt ) );
+	}
+
+	if( net.type == NET_HOST )
+	{
+		events.owner = &local_state;
+		events.epoch = session_token();
+		opt = get_option( argc, argv, "--rate" );
+		rates.hz = opt ? atoi( opt ) : RATE_DEFAULT_HZ;
+	}
+
+	/* Relays are headless */
+	if( net.type == NET_RELAY )
+	{
+		relay_loop();
+		timers_dump( 1 );
+		trace_write();
+		SDLNet_Quit();
+		return 0;
+	}
+
+	if( !init() )
+	{
+		printf( "an error occurred\n" );
+		quit();
+		return 1;
+	}
+
+	/* Only the side that owns the simulation can record it */
+	if( get_option( argc, argv, "--record" ) && ( net.type == NET_LOCAL || net.type == NET_HOST ) )
+	{
+		opt = get_option( argc, argv, "--keyframe" );
+
+		/* Keyframes only hold the one ball */
+		if( multiball.owner )
+			printf( "Chaos mode can't be recorded\n" );
+		else
+			replay_start( get_option( argc, argv, "--record" ), opt ? atoi( opt ) * 1000 : 5000 );
+	}
+	
+	switch( net.type )
+	{
+	case NET_LOCAL:
+		local_loop();
+		break;
+
+	case NET_HOST:
+		if( lockstep.active )
+			lockstep_loop();
+		else
+			server_loop();
+		break;
+
+	case NET_JOIN:
+		if( lockstep.active )
+			lockstep_loop();
+		else
+			client_loop();
+		break;
+
+	case NET_SPECTATE:
+		spectator_loop();
+		break;
+	}
+
+	replay_stop( &local_state );
+	timers_dump( 1 );
+	trace_write();
+
+	if( lagcomp.saves )
+	{
+		printf( "Lag compensation gave remote players %lu hits\n", lagcomp.saves );
+	}
+
+	if( rates.backoffs )
+	{
+		printf( "Snapshot rates were halved %lu times\n", rates.backoffs );
+	}
+
+	if( events.owner && events.next )
+	{
+		printf( "%u events sent, %lu resends\n", events.next, events.resent );
+	}
+
+	if( timesync.late || timesync.early )
+	{
+		printf( "Remote commands moved to a live tick: %lu late, %lu early\n", timesync.late, timesync.early );
+	}
+
+	if( local_cmd_buf && ( local_cmd_buf->grown || local_cmd_buf->dropped ) )
+	{
+		printf( "Command log peaked at %u commands: %lu blocks added, %lu commands dropped\n",
+			local_cmd_buf->peak, local_cmd_buf->grown, local_cmd_buf->dropped );
+	}
+
+	quit();
+	return 0;
+}
+
+int bot_main( int argc, char **argv )
+{
+	struct bot *bots;
+	const char *opt;
+	IPaddress host;
+	int count, skill, reaction;
+	int i;
 
-	r = (struct cmd_buf*)malloc( sizeof(struct cmd_buf) );
-	r->cmds = (struct cmd*)malloc( sizeof(struct cmd) * size );
-	r->maxlen = size;
-	r->len = 0;
+	opt = get_option( argc, argv, "--bots" );
+	count = opt ? atoi( opt ) : 1;
+	opt = get_option( argc, argv, "--skill" );
+	skill = opt ? atoi( opt ) : 80;
+	opt = get_option( argc, argv, "--reaction" );
+	reaction = opt ? atoi( opt ) : 150;
 
-	return r;
+	if( count < 1 || skill < 0 || skill > 100 || reaction < 0 )
+	{
+		printf( "Need at least one bot, a skill from 0 to 100 and a positive reaction time\n" );
+		return 1;
+	}
+
+	if( SDLNet_Init() < 0 )
+	{
+		printf( "Couldn't start SDLNet!\n" );
+		return 1;
+	}
+
+	if( !resolve_addr( &host, argv[2] ) )
+	{
+		printf( "Could not resolve %s\n", argv[2] );
+		return 1;
+	}
+
+	bots = (struct bot*)calloc( count, sizeof(struct bot) );
+	for( i = 0; i < count; i++ )
+	{
+		if( !bot_init( &bots[i], host, i ) )
+		{
+			printf( "Could only open %d sockets: %s\n", i, SDLNet_GetError() );
+			count = i;
+			break;
+		}
+	}
+
+	printf( "Running %d bots against %s, skill %d, reaction %dms\n", count, argv[2], skill, reaction );
+	bot_loop( bots, count, skill, reaction );
+
+	for( i = 0; i < count; i++ )
+	{
+		SDLNet_UDP_Close( bots[i].net.socket );
+	}
+	free( bots );
+	SDLNet_Quit();
+	return 0;
 }
 
-void free_cmd_buf( struct cmd_buf *p )
+int bot_init( struct bot *b, IPaddress host, int i )
 {
-	free( p->cmds );
-	free( p );
+	b->net.socket = SDLNet_UDP_Open( 0 );
+	if( b->net.socket == NULL )
+		return 0;
+
+	b->net.addr = host;
+	b->net.type = NET_JOIN;
+	b->net.state = NET_STATE_WAIT_ACK;
+	b->opener = i == 0 ? PACKET_SYN : PACKET_SPECTATE;
+	b->seed = 0x9E3779B9 * ( i + 1 );
+	init_gamestate( &b->state );
+	return 1;
 }
 
-void clear_cmd_buf( struct cmd_buf *p )
+void bot_loop( struct bot *bots, int count, int skill, int reaction )
 {
-	memset( p->cmds, 0, sizeof(struct cmd) * p->len );
-	p->len = 0;
+	Uint32 now, last = SDL_GetTicks();
+	Uint32 last_stats = last;
+	unsigned updates, cmds;
+	int i, playing;
+
+	while( running )
+	{
+		SDL_Delay( 1 );
+		now = SDL_GetTicks();
+		playing = bots_step( bots, count, skill, reaction, now, now - last, NULL );
+		last = now;
+
+		if( now - last_stats > RELAY_STATS_INTERVAL )
+		{
+			updates = cmds = 0;
+			for( i = 0; i < count; i++ )
+			{
+				updates += bots[i].updates;
+				cmds += bots[i].cmds;
+			}
+
+			printf( "bots: %d of %d playing, %u updates and %u commands so far\n", playing, count, updates, cmds );
+			fflush( stdout );
+			last_stats = now;
+		}
+	}
+}
+
+/*
+ * The first bot shakes hands as the real joiner and plays player 2.  The
+ * rest, and the first if the host has already started, come in as
+ * spectators, which only watch: they take updates, acknowledge events and
+ * ping, as a real spectator would.  Returns how many are in the game.
+ */
+int bots_step( struct bot *bots, int count, int skill, int reaction, Uint32 now, Uint32 dt, struct latency_log *lat )
+{
+	struct simple_packet sp;
+	struct clock_packet ping;
+	int i, playing = 0;
+
+	for( i = 0; i < count; i++ )
+	{
+		bot_recv( &bots[i], lat );
+
+		if( bots[i].net.state != NET_STATE_GAME )
+		{
+			if( bots[i].started == 0 )
+				bots[i].started = now;
+
+			if( now - bots[i].sent > HANDSHAKE_RETRY )
+			{
+				if( bots[i].opener == PACKET_SYN && now - bots[i].started > BOT_JOIN_TIMEOUT )
+					bots[i].opener = PACKET_SPECTATE;
+
+				sp.type = bots[i].opener;
+				net_simple_packet( &bots[i].net, &sp, bots[i].net.addr );
+				bots[i].sent = now;
+			}
+			continue;
+		}
+
+		if( bots[i].opener == PACKET_SPECTATE && now - bots[i].sent > SPECTATE_INTERVAL )
+		{
+			sp.type = PACKET_SPECTATE;
+			net_simple_packet( &bots[i].net, &sp, bots[i].net.addr );
+			bots[i].sent = now;
+		}
+
+		/* Only so the host can pace us as it would anyone; the answer
+		   isn't needed */
+		if( now - bots[i].last_ping > CLOCK_PING_MS )
+		{
+			memset( &ping, 0, sizeof(ping) );
+			ping.type = PACKET_PING;
+			ping.sent = now;
+			ping.received = bots[i].updates;
+			net_send( &bots[i].net, &ping, sizeof(ping), bots[i].net.addr );
+			bots[i].last_ping = now;
+		}
+
+		playing++;
+		if( bots[i].opener != PACKET_SYN )
+			continue;
+
+		if( now >= bots[i].next_think )
+		{
+			bot_think( &bots[i], skill );
+			bots[i].next_think = now + reaction;
+		}
+
+		bot_move( &bots[i], dt );
+	}
+
+	return playing;
+}
+
+/*
+ * Host and bot clocks share no epoch, so an update's age is measured
+ * against the quickest one this bot has seen: arrival time minus the
+ * state's time, less the smallest such difference so far.  That leaves
+ * only the queueing and processing delay on top of the best case.
+ */
+void bot_recv( struct bot *b, struct latency_log *lat )
+{
+	struct packet_view v;
+	const struct motion_packet *mp;
+	const struct events_packet *ep;
+	struct event_ack_packet ack;
+	struct simple_packet sp;
+	int32_t skew;
+
+	while( net_recv( &b->net, &v ) )
+	{
+		switch( v.type )
+		{
+		case PACKET_ACK:
+			if( b->net.state != NET_STATE_GAME )
+			{
+				sp.type = PACKET_SYNACK;
+				net_simple_packet( &b->net, &sp, b->net.addr );
+				b->net.state = NET_STATE_GAME;
+			}
+			break;
+
+		/* Bots don't keep score, but saying so saves the host resending */
+		case PACKET_EVENTS:
+			if( ( ep = packet_events( &v ) ) != NULL && ep->count > 0 )
+			{
+				ack.type = PACKET_EVENT_ACK;
+				ack.next = ep->events[ep->count - 1].seq + 1;
+				net_send( &b->net, &ack, sizeof(ack), v.from );
+			}
+			break;
+
+		case PACKET_MOTION:
+			if( ( mp = packet_motion( &v ) ) != NULL )
+			{
+				b->state.time = mp->time;
+				b->state.players[0] = mp->players[0];
+				b->state.players[1] = mp->players[1];
+				b->state.ball = mp->ball;
+				b->updates++;
+
+				if( lat != NULL )
+				{
+					skew = (int32_t)( SDL_GetTicks() - b->state.time );
+					if( !b->have_base || skew < b->clock_base )
+					{
+						b->clock_base = skew;
+						b->have_base = 1;
+					}
+
+					latency_add( lat, (uint32_t)( skew - b->clock_base ) );
+					lat->bytes += v.len;
+				}
+			}
+			break;
+		}
+	}
+}
+
+/* Aim for where the ball will cross our line, give or take our skill */
+void bot_think( struct bot *b, int skill )
+{
+	int x, err;
+
+	if( !predict_intercept( &b->state, &x ) )
+	{
+		x = WIN_WIDTH / 2;
+	}
+
+	err = ( 100 - skill ) * PADDLE_HEIGHT / 100;
+	if( err > 0 )
+	{
+		x += (int)( bot_rand( &b->seed ) % ( 2 * err + 1 ) ) - err;
+	}
+
+	b->target = x;
+}
+
+void bot_move( struct bot *b, Uint32 dt )
+{
+	struct cmd_packet cp;
+	scalar step;
+	int dist;
+
+	dist = b->target - ( SCALAR_TO_INT( b->state.players[1].offset ) + PADDLE_HEIGHT / 2 );
+	if( dt == 0 || abs( dist ) < BOT_DEADZONE )
+		return;
+
+	step = SCALAR_PER_MS( INT_TO_SCALAR( PADDLE_SPEED ), dt );
+	if( step > INT_TO_SCALAR( abs( dist ) ) )
+		step = INT_TO_SCALAR( abs( dist ) );
+
+	cp.type = PACKET_CMD;
+	cp.buf.len = 1;
+	cp.buf.cmds[0].type = CMD_PLAYER2_MOVE;
+	cp.buf.cmds[0].time = b->state.time;
+	cp.buf.cmds[0].data.offset = dist < 0 ? -step : step;
+	net_send( &b->net, &cp, sizeof(cp), b->net.addr );
+
+	/* Assume it lands until the host says otherwise */
+	b->state.players[1].offset += cp.buf.cmds[0].data.offset;
+	b->cmds++;
+}
+
+/*
+ * Run a copy of the game forward with the engine itself, so bounces off
+ * player 1's paddles come out exactly as handle_ball() will make them, and
+ * report the ball's centre when it reaches player 2's top or bottom line.
+ * Our own paddles are moved out of the way so they can't get in the way of
+ * the prediction.
+ */
+int predict_intercept( struct gamestate *gs, int *x )
+{
+	static struct cmd_buf *none;
+	struct gamestate sim;
+	uint32_t t;
+
+	if( none == NULL )
+		none = init_cmd_buf( 1 );
+
+	sim = *gs;
+	sim.players[1].offset = INT_TO_SCALAR( -WIN_WIDTH );
+	sim.time -= sim.time % physics_step;
+
+	for( t = 0; t < BOT_LOOKAHEAD; t += physics_step )
+	{
+		if( sim.ball.xv == 0 && sim.ball.yv == 0 )
+			return 0;
+
+		if( ( sim.ball.yv < 0 && sim.ball.y <= INT_TO_SCALAR( PADDLE_WIDTH ) )
+			|| ( sim.ball.yv > 0 && sim.ball.y + INT_TO_SCALAR( BALL_SIZE ) >= INT_TO_SCALAR( WIN_HEIGHT - PADDLE_WIDTH ) ) )
+		{
+			*x = SCALAR_TO_INT( sim.ball.x ) + BALL_SIZE / 2;
+			return 1;
+		}
+
+		advance_gamestate( sim.time, physics_step, physics_step, &sim, none );
+	}
+
+	return 0;
+}
+
+/* xorshift32, so every run with the same bots makes the same mistakes */
+uint32_t bot_rand( uint32_t *seed )
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+/*
+ * Sizes the host by ramping bots up against it, doubling the count every
+ * step until --clients are connected, and reporting the updates they got
+ * and how old those updates were when they arrived.
+ */
+int loadgen_main( int argc, char **argv )
+{
+	struct bot *bots;
+	struct latency_log lat;
+	const char *opt;
+	IPaddress host;
+	Uint32 now, last, step_start, step_ms;
+	unsigned updates;
+	int count, active, playing;
+	int i;
+
+	opt = get_option( argc, argv, "--clients" );
+	count = opt ? atoi( opt ) : 64;
+	opt = get_option( argc, argv, "--step" );
+	step_ms = opt ? atoi( opt ) * 1000 : LOADGEN_STEP;
+
+	if( count < 1 || step_ms == 0 )
+	{
+		printf( "Need at least one client and a step of at least a second\n" );
+		return 1;
+	}
+
+	if( SDLNet_Init() < 0 )
+	{
+		printf( "Couldn't start SDLNet!\n" );
+		return 1;
+	}
+
+	opt = get_option( argc, argv, "--host" );
+	if( opt == NULL || !resolve_addr( &host, opt ) )
+	{
+		printf( "Please specify a host to load with --host!\n" );
+		return 1;
+	}
+
+	bots = (struct bot*)calloc( count, sizeof(struct bot) );
+	for( i = 0; i < count; i++ )
+	{
+		if( !bot_init( &bots[i], host, i ) )
+		{
+			printf( "Could only open %d sockets: %s\n", i, SDLNet_GetError() );
+			count = i;
+			break;
+		}
+	}
+
+	memset( &lat, 0, sizeof(lat) );
+	printf( "Loading %s with up to %d clients, %us a step\n", opt, count, step_ms / 1000 );
+	printf( "clients playing  updates/s     KB/s   p50   p99  p999   max (ms)\n" );
+
+	for( active = 1; running && count > 0; active *= 2 )
+	{
+		if( active > count )
+			active = count;
+
+		lat.len = 0;
+		lat.bytes = 0;
+		updates = 0;
+		for( i = 0; i < active; i++ )
+			updates -= bots[i].updates;
+
+		step_start = last = SDL_GetTicks();
+		playing = 0;
+		do
+		{
+			SDL_Delay( 1 );
+			now = SDL_GetTicks();
+			playing = bots_step( bots, active, 80, 150, now, now - last, &lat );
+			last = now;
+		} while( running && now - step_start < step_ms );
+
+		for( i = 0; i < active; i++ )
+			updates += bots[i].updates;
+
+		qsort( lat.ages, lat.len, sizeof(uint32_t), compare_u32 );
+		printf( "%7d %7d %10.0f %8.1f %5u %5u %5u %5u\n", active, playing,
+			updates * 1000.0 / step_ms, lat.bytes / 1.024 / step_ms,
+			latency_percentile( &lat, 500 ), latency_percentile( &lat, 990 ),
+			latency_percentile( &lat, 999 ), latency_percentile( &lat, 1000 ) );
+		fflush( stdout );
+
+		if( active == count )
+			break;
+	}
+
+	for( i = 0; i < count; i++ )
+	{
+		SDLNet_UDP_Close( bots[i].net.socket );
+	}
+	free( lat.ages );
+	free( bots );
+	SDLNet_Quit();
+	return 0;
+}
+
+void latency_add( struct latency_log *lat, uint32_t age )
+{
+	if( lat->len == lat->cap )
+	{
+		lat->cap = lat->cap ? lat->cap * 2 : 4096;
+		lat->ages = (uint32_t*)realloc( lat->ages, lat->cap * sizeof(uint32_t) );
+	}
+
+	lat->ages[lat->len++] = age;
+}
+
+/* Expects the ages sorted; permille 1000 is the maximum */
+uint32_t latency_percentile( struct latency_log *lat, unsigned permille )
+{
+	if( lat->len == 0 )
+		return 0;
+
+	return lat->ages[ (uint64_t)( lat->len - 1 ) * permille / 1000 ];
+}
+
+int compare_u32( const void *a, const void *b )
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Resolves "host" or "host:port", defaulting to PORTNUM */
+int resolve_addr( IPaddress *addr, const char *spec )
+{
+	char host[256];
+	const char *colon;
+	Uint16 port = PORTNUM;
+
+	colon = strrchr( spec, ':' );
+	if( colon == NULL || colon - spec >= (int)sizeof(host) )
+	{
+		return SDLNet_ResolveHost( addr, spec, port ) == 0;
+	}
+
+	memcpy( host, spec, colon - spec );
+	host[ colon - spec ] = '\0';
+	port = atoi( colon + 1 );
+
+	return SDLNet_ResolveHost( addr, host, port ) == 0;
+}
+
+/* Returns the value following a "--name" option, or NULL if it wasn't given */
+const char *get_option( int argc, char **argv, const char *name )
+{
+	int i;
+
+	for( i = 1; i < argc - 1; i++ )
+	{
+		if( strcmp( argv[i], name ) == 0 )
+			return argv[i + 1];
+	}
+
+	return NULL;
+}
+
+/* The tools return from main before the game's own exit, but still owe
+   whatever --timers and --trace asked for */
+int tool_exit( int status )
+{
+	timers_dump( 1 );
+	trace_write();
+	return status;
+}
+
+/*
+ * Sets up the impairment layer from the --net-* options.  Every send in
+ * the process goes through it, so running both ends impaired emulates a
+ * bad link in both directions.  The same seed makes the same decisions
+ * for the same sequence of sends.
+ */
+int impair_init( int argc, char **argv )
+{
+	const char *opt;
+
+	memset( &impair, 0, sizeof(impair) );
+
+	if( ( opt = get_option( argc, argv, "--net-delay" ) ) != NULL )
+		impair.delay = atoi( opt );
+	if( ( opt = get_option( argc, argv, "--net-jitter" ) ) != NULL )
+		impair.jitter = atoi( opt );
+	if( ( opt = get_option( argc, argv, "--net-loss" ) ) != NULL )
+		impair.loss = atof( opt );
+	if( ( opt = get_option( argc, argv, "--net-dup" ) ) != NULL )
+		impair.dup = atof( opt );
+	if( ( opt = get_option( argc, argv, "--net-reorder" ) ) != NULL )
+		impair.reorder = atof( opt );
+	if( ( opt = get_option( argc, argv, "--net-rate" ) ) != NULL )
+		impair.rate = atoi( opt );
+	opt = get_option( argc, argv, "--net-seed" );
+	impair.seed = opt ? (uint32_t)strtoul( opt, NULL, 0 ) : 1;
+
+	if( impair.seed == 0 || impair.loss < 0 || impair.loss > 100 || impair.dup < 0 || impair.dup > 100
+		|| impair.reorder < 0 || impair.reorder > 100 )
+	{
+		printf( "Percentages must be from 0 to 100 and the seed can't be 0\n" );
+		return 0;
+	}
+
+	impair.active = impair.delay || impair.jitter || impair.loss || impair.dup || impair.reorder || impair.rate;
+	if( impair.active )
+	{
+		printf( "Impairing sends: %ums +/- %ums, %.1f%% loss, %.1f%% duplicated, %.1f%% reordered, ",
+			impair.delay, impair.jitter, impair.loss, impair.dup, impair.reorder );
+		if( impair.rate )
+			printf( "%ukbit/s, seed %u\n", impair.rate, impair.seed );
+		else
+			printf( "no rate cap, seed %u\n", impair.seed );
+	}
+
+	return 1;
+}
+
+int impair_chance( double percent )
+{
+	if( percent <= 0 )
+		return 0;
+
+	return bot_rand( &impair.seed ) % 100000 < (uint32_t)( percent * 1000 );
 }
 
-void player_move_cmd( struct cmd *out, int type, float offset )
-{
-	out->data.offset = offset;
-	out->type = type;
-	out->time = SDL_GetTicks() - start_time;
+/*
+ * Decides what happens to one send: dropped, or queued once or twice to
+ * go out after the link's transmission time, the delay and some jitter.
+ * A packet picked for reordering is held back behind the ones after it.
+ */
+int impair_send( UDPsocket socket, const void *data, int len, IPaddress to )
+{
+	uint64_t now_us;
+	Uint32 now, base, due;
+	int copies, offset;
+
+	now = SDL_GetTicks();
+
+	if( impair_chance( impair.loss ) )
+		return 1;
+
+	base = now;
+	if( impair.rate )
+	{
+		now_us = (uint64_t)now * 1000;
+		if( impair.link_free < now_us )
+			impair.link_free = now_us;
+
+		if( impair.link_free - now_us > IMPAIR_QUEUE_MS * 1000 )
+			return 1;
+
+		impair.link_free += (uint64_t)len * 8 * 1000 / impair.rate;
+		base = (Uint32)( impair.link_free / 1000 );
+	}
+
+	copies = impair_chance( impair.dup ) ? 2 : 1;
+	while( copies-- )
+	{
+		due = base + impair.delay;
+		if( impair.jitter )
+		{
+			offset = (int)( bot_rand( &impair.seed ) % ( 2 * impair.jitter + 1 ) ) - (int)impair.jitter;
+			if( offset < 0 && (Uint32)-offset > impair.delay )
+				due = base;
+			else
+				due += offset;
+		}
+
+		if( impair_chance( impair.reorder ) )
+			due += IMPAIR_REORDER_MS;
+
+		impair_enqueue( socket, data, len, to, due );
+	}
+
+	return 1;
 }
 
-int add_to_cmd_buf( struct cmd_buf *buf, struct cmd cmd )
+void impair_enqueue( UDPsocket socket, const void *data, int len, IPaddress to, Uint32 due )
 {
-	if( buf->len == buf->maxlen )
-		return 0;
+	struct impaired_packet *ip, *tmp;
+	int i, parent;
+
+	ip = (struct impaired_packet*)malloc( sizeof(struct impaired_packet) + len );
+	ip->due = due;
+	ip->seq = impair.seq++;
+	ip->socket = socket;
+	ip->to = to;
+	ip->len = len;
+	memcpy( ip->data, data, len );
+
+	if( impair.count == impair.cap )
+	{
+		impair.cap = impair.cap ? impair.cap * 2 : 64;
+		impair.queue = (struct impaired_packet**)realloc( impair.queue, sizeof(struct impaired_packet*) * impair.cap );
+	}
 
-	buf->len += 1;
-	buf->cmds[ buf->len-1 ] = cmd;
-	return 1;
+	i = impair.count++;
+	impair.queue[i] = ip;
+	while( i > 0 )
+	{
+		parent = ( i - 1 ) / 2;
+		tmp = impair.queue[parent];
+		if( impair_before( tmp, ip ) )
+			break;
+
+		impair.queue[parent] = ip;
+		impair.queue[i] = tmp;
+		i = parent;
+	}
 }
 
-struct cmd_net_buf *cmd_to_net( struct cmd_buf *in )
+int impair_before( struct impaired_packet *a, struct impaired_packet *b )
 {
-	uint8_t *p;
-	struct cmd_net_buf *r = (struct cmd_net_buf*)malloc( sizeof( uint32_t ) + ( in->len * sizeof( struct cmd ) ) );
-	r->len = in->len;
-	p = (uint8_t*) (((uint32_t*)r)+1);
-	memcpy( p, in->cmds, in->len * sizeof(struct cmd) );
-	return r;
+	if( a->due != b->due )
+		return (int32_t)( a->due - b->due ) < 0;
+
+	return (int32_t)( a->seq - b->seq ) < 0;
 }
 
-void advance_gamestate( uint32_t start, uint32_t duration, uint32_t timestep, struct gamestate *gs, struct cmd_buf *buf )
+/* Sends everything that has come due, earliest first */
+void impair_flush()
 {
-	uint32_t i;
-	unsigned ci;
+	struct impaired_packet *ip, *tmp;
+	Uint32 now = SDL_GetTicks();
+	int i, child;
 
-	for( i = 0; i < duration; i++ )
+	while( impair.count > 0 && (int32_t)( now - impair.queue[0]->due ) >= 0 )
 	{
-		for( ci = 0; ci < buf->len; ci++ )
+		ip = impair.queue[0];
+
+		impair.out.channel = -1;
+		impair.out.address = ip->to;
+		impair.out.data = ip->data;
+		impair.out.len = ip->len;
+		impair.out.maxlen = ip->len;
+		if( SDLNet_UDP_Send( ip->socket, -1, &impair.out ) == 0 )
 		{
-			if( ( i + start ) == buf->cmds[ci].time )
-			{
-				switch( buf->cmds[ci].type )
-				{
-				case CMD_PLAYER1_MOVE:
-					gs->players[0].offset += buf->cmds[ci].data.offset;
-					break;
-
-				case CMD_PLAYER2_MOVE:
-					gs->players[1].offset += buf->cmds[ci].data.offset;
-					break;
-				}
-			}
+			printf( "Failed to send packet: %s", SDLNet_GetError() );
+			fflush( stdout );
 		}
+		free( ip );
 
-		gs->players[0].rect[0].y = gs->players[0].offset;
-		gs->players[1].rect[0].x = gs->players[1].offset;
-		gs->players[0].rect[1].y = gs->players[0].offset;
-		gs->players[1].rect[1].x = gs->players[1].offset;
-
-		if( ( i + start ) % timestep == 0 )
+		impair.count--;
+		impair.queue[0] = impair.queue[ impair.count ];
+		i = 0;
+		for( ;; )
 		{
-			gs->ball.x += gs->ball.xv * ( timestep / 1000.f );
-			gs->ball.y += gs->ball.yv * ( timestep / 1000.f );
+			child = 2 * i + 1;
+			if( child >= impair.count )
+				break;
+
+			if( child + 1 < impair.count && impair_before( impair.queue[child + 1], impair.queue[child] ) )
+				child++;
 
-			gs->ball.rect.x = gs->ball.x;
-			gs->ball.rect.y = gs->ball.y;
+			tmp = impair.queue[child];
+			if( impair_before( impair.queue[i], tmp ) )
+				break;
 
-			handle_ball( &gs->ball, &gs->players[0], &gs->players[1] );
+			impair.queue[child] = impair.queue[i];
+			impair.queue[i] = tmp;
+			i = child;
 		}
 	}
 }
 
-int net_bind( struct net *pnet )
+void timers_init( Uint32 interval )
 {
-	SDLNet_ResolveHost( &pnet->addr, NULL, PORTNUM );
-	pnet->socket = SDLNet_UDP_Open( PORTNUM );
-	if( pnet->socket == 0 )
-	{
-		printf( "%s", SDLNet_GetError() );
-		return 0;
-	}
-	
-	printf( "Bound on port: %u\n", ( SDL_BYTEORDER == SDL_LIL_ENDIAN ) ? SDL_Swap16( pnet->addr.port ) : pnet->addr.port );
+	memset( &timers, 0, sizeof(timers) );
+	timers.active = 1;
+	timers.interval = interval;
+	timers.last_dump = SDL_GetTicks();
+	timers.freq = SDL_GetPerformanceFrequency();
+}
 
-	return 1;
+void timer_start( int phase )
+{
+	if( tracer.active )
+		trace_event( phase_names[phase], 'B', 0 );
+
+	if( timers.active )
+		timers.started[phase] = SDL_GetPerformanceCounter();
 }
 
-int net_recv( struct net *pnet, void *outbuf, int buflen, int *outlen, IPaddress *ip )
+void timer_stop( int phase )
 {
-	UDPpacket *p;
-	int err;
+	Uint64 ticks;
 
-	p = SDLNet_AllocPacket( MAXPACKETSIZE );
+	if( tracer.active )
+		trace_event( phase_names[phase], 'E', 0 );
 
-	if( ( err = SDLNet_UDP_Recv( pnet->socket, p ) ) > 0 )
-	{
-		memcpy( outbuf, p->data, p->len );
-		*outlen = p->len;
-		*ip = p->address;
-		return 1;
-	}
-	else if( err == -1 )
+	if( !timers.active )
+		return;
+
+	ticks = SDL_GetPerformanceCounter() - timers.started[phase];
+	histogram_add( &timers.recent[phase], ticks * 1000000000 / timers.freq );
+}
+
+/* Closes off the frame and dumps the timers if it's time to */
+void timers_frame()
+{
+	timer_stop( PHASE_FRAME );
+
+	if( timers.active && timers.interval && SDL_GetTicks() - timers.last_dump >= timers.interval )
 	{
-		printf( "%s", SDLNet_GetError() );
-		return 0;
+		timers_dump( 0 );
+		timers.last_dump = SDL_GetTicks();
 	}
-
-	SDLNet_FreePacket( p );
-	
-	return 0;
 }
 
-int net_send( struct net *pnet, void *inbuf, int inlen, IPaddress to )
+/* Prints the phases since the last dump, or over the whole run at exit */
+void timers_dump( int final )
 {
-	UDPpacket *p;
-	int err;
+	struct histogram *h;
+	int i;
 
-	p = SDLNet_AllocPacket( MAXPACKETSIZE );
+	if( !timers.active )
+		return;
 
-	p->address.host = to.host;
-	p->address.port = to.port;
+	printf( "%s     count     p50     p90     p99     max (us)\n", final ? "whole run" : "timers   " );
+	for( i = 0; i < PHASE_COUNT; i++ )
+	{
+		histogram_merge( &timers.run[i], &timers.recent[i] );
+		h = final ? &timers.run[i] : &timers.recent[i];
 
-	memcpy( p->data, inbuf, inlen );
+		if( h->total )
+		{
+			printf( "%-9s %9u %7.1f %7.1f %7.1f %7.1f\n", phase_names[i], h->total,
+				histogram_percentile( h, 50 ) / 1000.0, histogram_percentile( h, 90 ) / 1000.0,
+				histogram_percentile( h, 99 ) / 1000.0, h->max / 1000.0 );
+		}
 
-	p->len = inlen;
+		memset( &timers.recent[i], 0, sizeof(struct histogram) );
+	}
+	fflush( stdout );
+}
 
-	err = SDLNet_UDP_Send( pnet->socket, -1, p );
-	if( err == 0 )
+/*
+ * Values below HIST_SUB get a bucket each.  Above that the top bit picks
+ * a row of HIST_SUB buckets and the next HIST_SUB_BITS bits pick the
+ * bucket within it.
+ */
+void histogram_add( struct histogram *h, uint64_t value )
+{
+	unsigned row = 0;
+	uint64_t v = value >> HIST_SUB_BITS;
+
+	while( v )
 	{
-		printf( "Failed to send packet: %s", SDLNet_GetError() );
-		fflush( stdout );
+		row++;
+		v >>= 1;
 	}
 
-	SDLNet_FreePacket( p );
+	if( row >= HIST_BUCKETS / HIST_SUB )
+	{
+		h->counts[HIST_BUCKETS - 1]++;
+	}
+	else if( row == 0 )
+	{
+		h->counts[value]++;
+	}
+	else
+	{
+		h->counts[ row * HIST_SUB + ( ( value >> ( row - 1 ) ) - HIST_SUB ) ]++;
+	}
 
-	return err;
+	h->total++;
+	if( value > h->max )
+		h->max = value;
 }
 
-/* Send a packet without game state data (syn, ack, etc) */
-int net_simple_packet( struct net *pnet, struct simple_packet *packet, IPaddress to )
+void histogram_merge( struct histogram *into, struct histogram *from )
 {
-	return net_send( pnet, (void*)packet, sizeof(struct simple_packet), to );
-}
+	int i;
 
-int net_send_update( struct net *pnet, IPaddress to, struct gamestate *gs )
-{
-	struct update_packet up;
-	up.state = *gs;
-	up.type = PACKET_UPDATE;
-	return net_send( pnet, &up, sizeof(struct update_packet), to );
+	for( i = 0; i < HIST_BUCKETS; i++ )
+		into->counts[i] += from->counts[i];
+
+	into->total += from->total;
+	if( from->max > into->max )
+		into->max = from->max;
 }
 
-int net_send_cmd_buf( struct net *pnet, IPaddress to, struct cmd_buf *in )
+/* Returns the highest value the percentile's bucket could hold */
+uint64_t histogram_percentile( struct histogram *h, unsigned percent )
 {
-	struct cmd_packet *cp;
-	struct cmd_net_buf *nb;
-	unsigned size;
-	int err;
+	uint64_t want, edge, seen = 0;
+	unsigned row;
+	int i;
 
-	size = sizeof( struct cmd_packet ) + ( sizeof( struct cmd ) * ( in->len - 1 ) );
-	cp = (struct cmd_packet *)malloc( size );
-	nb = cmd_to_net( in );
+	want = ( (uint64_t)h->total * percent + 99 ) / 100;
+	for( i = 0; i < HIST_BUCKETS; i++ )
+	{
+		seen += h->counts[i];
+		if( seen >= want && seen > 0 )
+			break;
+	}
 
-	memcpy( &cp->buf, nb, sizeof( struct cmd_net_buf ) + ( sizeof( struct cmd ) * ( in->len - 1 ) ) );
+	if( i == HIST_BUCKETS )
+		return h->max;
 
-	cp->type = PACKET_CMD;
+	row = i / HIST_SUB;
+	if( row == 0 )
+		edge = i;
+	else
+		edge = ( (uint64_t)( i % HIST_SUB + HIST_SUB + 1 ) << ( row - 1 ) ) - 1;
 
-	err = net_send( pnet, cp, size, to );
+	return edge < h->max ? edge : h->max;
+}
 
-	free( nb );
-	return err;
+void trace_init( const char *path )
+{
+	memset( &tracer, 0, sizeof(tracer) );
+	tracer.path = path;
+	tracer.freq = SDL_GetPerformanceFrequency();
+	tracer.base = SDL_GetPerformanceCounter();
+	tracer.active = 1;
+
+	trace_register( "main" );
 }
 
-/*int net_thread( void *ptr )
+/* Gives the calling thread its own buffer and links it where trace_write()
+   will find it */
+struct trace_thread *trace_register( const char *name )
 {
-	uint8_t buf[MAXPACKETSIZE];
-	int buflen = MAXPACKETSIZE;
-	int recvbytes;
-	struct net *pnet = (struct net*)ptr;
-	IPaddress ip;
-	struct simple_packet *sp;
-	struct update_packet *up;
-	struct cmd_packet *cp;
-	int i;
+	struct trace_thread *t;
 
-	while( running )
-	{
-		if( !net_recv( pnet, (void*)buf, buflen, &recvbytes, &ip ) )
-		{
-			continue;
-		}
+	t = (struct trace_thread*)calloc( 1, sizeof(struct trace_thread) );
+	t->name = name ? name : "thread";
+	t->tid = SDL_AtomicAdd( &tracer.next_tid, 1 ) + 1;
+	t->head = t->tail = (struct trace_chunk*)calloc( 1, sizeof(struct trace_chunk) );
 
-		sp = (struct simple_packet*)buf;
+	do
+	{
+		t->next = (struct trace_thread*)SDL_AtomicGetPtr( (void**)&tracer.threads );
+	} while( !SDL_AtomicCASPtr( (void**)&tracer.threads, t->next, t ) );
 
-		printf( "Packet received!\n" );  
+	trace_self = t;
+	return t;
+}
 
-		switch( pnet->state )
-		{
-		case NET_STATE_WAIT_SYN:
-			if( sp->type == PACKET_SYN )
-			{
-				printf( "SYN received, sending ACK\n" );
-				pnet->addr.host = ip.host;
-				net_simple_packet( pnet, PACKET_ACK, pnet->addr );
-				pnet->state = NET_STATE_WAIT_SYNACK;
-			}
-			break;
-		case NET_STATE_WAIT_ACK:
-			if( sp->type == PACKET_ACK )
-			{
-				printf( "ACK received, sending SYNACK\n" );
-				net_simple_packet( pnet, PACKET_SYNACK, pnet->addr );
-				pnet->state = NET_STATE_GAME;
-			}
-			break;
-		case NET_STATE_WAIT_SYNACK:
-			if( sp->type == PACKET_SYNACK )
-			{
-				printf( "Got SYNACK\n" );
-				pnet->state = NET_STATE_GAME;
-				net_send_update( pnet, pnet->addr );
-			}
-			break;
-		case NET_STATE_GAME:
-			if( pnet->state == NET_JOIN && sp->type == PACKET_UPDATE )
-			{
-				up = (struct update_packet*)sp;
-				local_state = up->state;
-			}
+/* The hot path: a thread local load, a counter read and a store */
+void trace_event( const char *name, int ph, int arg )
+{
+	struct trace_thread *t = trace_self;
+	struct trace_record *r;
 
-			if( pnet->state == NET_HOST && sp->type == PACKET_CMD )
-			{
-				cp = (struct cmd_packet*)sp;
-				for( i = 0; i < cp->buf.len; i++ )
-				{
-					add_to_cmd_buf( local_cmd_buf, cp->buf.cmds[i] );
-				}
-			}
-			break;
-		}
+	if( t == NULL )
+		t = trace_register( NULL );
 
-		memset( buf, 0, MAXPACKETSIZE );
+	if( t->tail->len == TRACE_CHUNK )
+	{
+		t->tail->next = (struct trace_chunk*)calloc( 1, sizeof(struct trace_chunk) );
+		t->tail = t->tail->next;
 	}
 
-	return 0;
-}*/
+	r = &t->tail->records[ t->tail->len++ ];
+	r->ts = SDL_GetPerformanceCounter();
+	r->name = name;
+	r->arg = arg;
+	r->ph = ph;
+}
 
-/*void net_create_thread( struct net *pnet )
+/* Writes every thread's events out as Chrome trace_event JSON */
+void trace_write()
 {
-	SDL_CreateThread(net_thread, "net", pnet);
-}*/
+	struct trace_thread *t, *next_t;
+	struct trace_chunk *c, *next_c;
+	struct trace_record *r;
+	unsigned long count = 0;
+	FILE *f;
+	int i;
 
-int main( int argc, char **argv )
-{
-	struct simple_packet sp;
+	if( !tracer.active )
+		return;
 
-	sp.type = PACKET_SYN;
-	running = 1;
+	tracer.active = 0;
 
-	if( argc > 1 )
+	f = fopen( tracer.path, "w" );
+	if( f == NULL )
 	{
-		if( strcmp( "join", argv[1] ) == 0 )
-		{
-			if( argc < 3 )
-			{
-				printf( "Please specify a host to connect to!\n" );
-				return 1;
-			}
-			net.type = NET_JOIN;
-		}
-		else if( strcmp( "host", argv[1] ) == 0 )
-		{
-			net.type = NET_HOST;
-		}
-		else
-		{
-			printf( "Unknown argument!\n" );
-			return 1;
-		}
+		printf( "Couldn't write trace to %s: %s\n", tracer.path, strerror( errno ) );
+	}
+	else
+	{
+		fprintf( f, "{\"traceEvents\":[\n" );
+	}
 
-		if( !net_init() )
+	for( t = tracer.threads; t != NULL; t = next_t )
+	{
+		if( f != NULL )
 		{
-			printf( "Could not init network, exiting!\n" );
-			return 1;
+			fprintf( f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", t->tid, t->name );
 		}
 
-		if( net.type == NET_JOIN )
+		for( c = t->head; c != NULL; c = next_c )
 		{
-			SDLNet_ResolveHost( &net.addr, argv[2], PORTNUM );
+			for( i = 0; f != NULL && i < c->len; i++ )
+			{
+				r = &c->records[i];
+				fprintf( f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", r->name, r->ph, t->tid,
+					(double)( r->ts - tracer.base ) * 1000000.0 / tracer.freq );
+
+				if( r->ph == 'i' )
+					fprintf( f, ",\"s\":\"t\",\"args\":{\"n\":%d}}", r->arg );
+				else if( r->ph == 'B' && r->arg )
+					fprintf( f, ",\"args\":{\"n\":%d}}", r->arg );
+				else
+					fprintf( f, "}" );
+
+				count++;
+			}
+
+			next_c = c->next;
+			free( c );
 		}
 
-		net_wait_for_game( &net );
-	}
-	else
-	{
-		net.type = NET_LOCAL;
-	}
+		if( f != NULL && t->next != NULL )
+			fprintf( f, ",\n" );
 
-	if( !init() )
-	{
-		printf( "an error occurred\n" );
-		quit();
-		return 1;
+		next_t = t->next;
+		free( t );
 	}
-	
-	switch( net.type )
-	{
-	case NET_LOCAL:
-		local_loop();
-		break;
-
-	case NET_HOST:
-		server_loop();
-		break;
 
-	case NET_JOIN:
-		client_loop();
-		break;
+	if( f != NULL )
+	{
+		fprintf( f, "\n]}\n" );
+		fclose( f );
+		printf( "Wrote %lu trace events to %s\n", count, tracer.path );
 	}
-
-	quit();
-	return 0;
-}
\ No newline at end of file
+}